@@ -0,0 +1,17 @@
+#ifndef BULKVERIFY_H
+#define BULKVERIFY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "../include/pos.h"
+
+#define PROOF_CHUNK_RECORDS (1 << 16) //Proofs read from the stream per chunk
+#define MAX_REPORTED_FAILURES 16
+
+size_t verify_records_bulk(const Record* records, size_t count, bool* valid, int num_threads); //Returns how many records fail, valid may be NULL
+ssize_t verify_proof_file(const char* filename, int num_threads, size_t* num_proofs); //Stream of 16 byte records, returns the failures or -1
+
+#endif
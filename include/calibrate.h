@@ -0,0 +1,24 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "pos.h"
+
+#define DEFAULT_PROFILE "hashgen.profile"
+#define CALIBRATE_MIN_SECONDS 0.5 //Each probe repeats until it has run at least this long
+#define CALIBRATE_KEEP 0.95 //Take the fewest threads within this share of the best throughput
+
+typedef struct {
+    int num_threads_hash;
+    int num_threads_sort;
+    int num_threads_write;
+} TuningProfile;
+
+int calibrate(const char* scratch_dir, int max_threads, TuningProfile* profile); //Time hashing, sorting and temp file writes at 1, 2, 4... threads on this machine and device
+int profile_save(const TuningProfile* profile, const char* filename);
+int profile_load(TuningProfile* profile, const char* filename); //Returns 1 if there is no profile or it was saved by a build with another K, B or R, leaving profile untouched
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "pos.h"
+
+#define CHECKSUM_MAGIC "POSSUMS1"
+#define CHECKSUM_SUFFIX ".sums"
+#define CHECKSUM_READ_SIZE (8 << 20) //Quick verification reads the plot in chunks of at least this many bytes
+
+typedef struct { //64 byte header of the side file, one u64 checksum per bucket follows
+    char magic[8];
+    uint64_t num_buckets;
+    uint64_t bucket_size; //Bytes covered by each checksum, the count header, the records and the padding
+    uint64_t nonce_end; //The plot was hashed from nonces below this, 0 in side files written before it was recorded
+    uint8_t reserved[32];
+} ChecksumHeader;
+
+typedef struct BucketChecksums {
+    ChecksumHeader header;
+    uint64_t* sums;
+} BucketChecksums;
+
+int checksums_init(BucketChecksums* checksums);
+void checksums_free(BucketChecksums* checksums);
+
+uint64_t bucket_checksum(const uint8_t* bucket, size_t size); //First 8 bytes of the BLAKE3 digest of the bucket
+void checksums_add_bucket(BucketChecksums* checksums, size_t bucket_index, const Record* records, size_t count, BucketLayout layout); //Checksum of the bucket as it lands on disk, records in their stored order, zero padding included
+bool checksums_match(const BucketChecksums* checksums, size_t bucket_index, const uint8_t* bucket); //bucket holds header.bucket_size bytes
+
+int checksums_save(const BucketChecksums* checksums, const char* plot_filename); //Written next to the plot as <plot>.sums
+int checksums_load(BucketChecksums* checksums, const char* plot_filename); //Returns 1 if there is no side file for this plot
+int checksums_read_header(const char* plot_filename, ChecksumHeader* header); //Header only, for a plot of any K, returns 1 if there is no side file
+
+#endif
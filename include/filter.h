@@ -0,0 +1,42 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "pos.h"
+
+#define FILTER_MAGIC "POSFLTR1"
+#define FILTER_SUFFIX ".filter"
+#define FILTER_BLOCK_WORDS 8 //One 64 byte cache line per block, every probe for a key lands in the same block
+#define FILTER_MAX_PREFIX_BYTES 8
+#define FILTER_MAX_BITS_PER_KEY 64 //Far past the point where more bits help, also bounds what a side file may ask to allocate
+#define FILTER_BLOCKS_FOR(bits_per_key, records) (((bits_per_key) * (records) + FILTER_BLOCK_WORDS * 64 - 1) / (FILTER_BLOCK_WORDS * 64))
+
+typedef struct { //64 byte header of the side file, the blocks of bucket 0 come first after it
+    char magic[8];
+    uint32_t prefix_bytes; //Leading hash bytes that were inserted, queries need at least this many
+    uint32_t bits_per_key;
+    uint32_t num_probes; //Bits set per key inside its block
+    uint32_t blocks_per_bucket;
+    uint64_t num_buckets;
+    uint8_t reserved[32];
+} FilterHeader;
+
+typedef struct BucketFilter {
+    FilterHeader header;
+    uint64_t* blocks;
+} BucketFilter;
+
+int default_filter_prefix_bytes(void); //Enough bytes that a random prefix misses the plot most of the time
+int filter_init(BucketFilter* filter, int bits_per_key, int prefix_bytes, size_t records_per_bucket); //Blocked Bloom filter per bucket, sized for a full bucket
+void filter_free(BucketFilter* filter);
+
+void filter_add_bucket(BucketFilter* filter, size_t bucket_index, const Record* records, size_t count); //Safe to call from different threads for different buckets
+bool filter_may_contain(const BucketFilter* filter, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes); //false means the prefix is definitely not in the bucket
+
+int filter_save(const BucketFilter* filter, const char* plot_filename); //Written next to the plot as <plot>.filter
+int filter_load(BucketFilter* filter, const char* plot_filename); //Returns 1 if there is no side file for this plot
+
+#endif
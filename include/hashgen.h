@@ -0,0 +1,33 @@
+#ifndef HASHGEN_H
+#define HASHGEN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../include/pos.h"
+
+typedef struct {
+    char** output_files; //Stripes of the plot in bucket order, or the single shard file
+    size_t num_outputs;
+    char** scratch_dirs; //One temp file per directory, batches are dealt round robin
+    size_t num_scratch_dirs;
+    bool shard_mode; //Write a shard of the nonce range for shardmerge instead of a plot
+    uint64_t start_nonce;
+    uint64_t num_nonces; //0 for every nonce from start_nonce on, filled in once the plot is written
+    const char* extend_file; //Plot from a smaller K to extend, NULL to build from nonce 0
+    bool in_memory;
+    bool recompute; //Hash every nonce once per bucket range that fits in memory_mb instead of spilling to a temp file
+    size_t num_passes; //Bucket range passes a recompute plot took, filled in once it is written
+    int memory_mb;
+    int filter_bits_per_key; //0 for no filter
+    int filter_prefix_bytes;
+    BucketLayout layout; //Record order inside each plot bucket
+    int num_threads_hash;
+    int num_threads_sort;
+    int num_threads_write;
+} PlotOptions;
+
+int generate_plot(PlotOptions* options, ProgressCallback callback, void* user); //Hash, sort and write the plot with its side files, 0 on success
+
+#endif
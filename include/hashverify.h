@@ -8,9 +8,11 @@
 
 #include "../include/pos.h"
 
-ssize_t verify_hashes_file(const char* filename, bool verify_hashes); // Go through buckets and make sure they are in order
+ssize_t verify_hashes_file(const char* filename, size_t* num_unsorted, bool debug); // Go through buckets and make sure they are in order, returns the records seen
 int verify_random_hashes(const char* filename, size_t count); // Generate random index values. Sort them and then go through the file once checking if they line up with the BLAKE3 hashes
 int verify_hash(const Record* record); // check a nonce against the BLAKE3 hash
+int digest_file(const char* filename, uint8_t* digest); // BLAKE3_OUT_LEN byte digest of every byte in the file, headers and padding included, or of comma separated stripes in order
+ssize_t verify_checksums_file(const char* filename, int num_threads); // Check every bucket of a plot, or of its comma separated stripes, against the .sums side file in large parallel reads, returns the buckets that fail
 
 
 void print_record(const Record* record, size_t record_ct); //Print records
@@ -0,0 +1,70 @@
+#ifndef KEYS_H
+#define KEYS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pos.h"
+
+//Fixed width kernels for the HASH_SIZE byte keys. Hashes are compared as big-endian integers,
+//so the first 8 bytes become one 64-bit load and the remaining bytes a second, smaller load.
+
+static inline uint64_t key_load_be64(const uint8_t* bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value)); //memcpy compiles to a single unaligned load
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline uint16_t key_load_be16(const uint8_t* bytes) {
+    return (uint16_t)((bytes[0] << 8) | bytes[1]);
+}
+
+static inline int key_compare(const uint8_t* a, const uint8_t* b) { //Same sign as memcmp(a, b, HASH_SIZE), without branches
+#if HASH_SIZE == 10
+    uint64_t a_hi = key_load_be64(a), b_hi = key_load_be64(b);
+    uint16_t a_lo = key_load_be16(a + 8), b_lo = key_load_be16(b + 8);
+    int hi = (a_hi > b_hi) - (a_hi < b_hi);
+    int lo = (a_lo > b_lo) - (a_lo < b_lo);
+    return 2 * hi + lo; //The high word decides unless it is equal
+#else
+    return memcmp(a, b, HASH_SIZE);
+#endif
+}
+
+static inline int key_equal(const uint8_t* a, const uint8_t* b) {
+#if HASH_SIZE == 10
+    return ((key_load_be64(a) ^ key_load_be64(b)) | (uint64_t)(key_load_be16(a + 8) ^ key_load_be16(b + 8))) == 0;
+#else
+    return memcmp(a, b, HASH_SIZE) == 0;
+#endif
+}
+
+static inline uint64_t key_prefix(const uint8_t* hash, int num_bytes) { //First num_bytes (at most 8) as an integer, from a single load
+    if (num_bytes <= 0) return 0;
+    return key_load_be64(hash) >> (64 - 8 * num_bytes);
+}
+
+static inline int key_compare_prefix(const uint8_t* a, const uint8_t* b, int num_bytes) { //Same sign as memcmp(a, b, num_bytes)
+    if (num_bytes >= HASH_SIZE) return key_compare(a, b);
+    if (num_bytes > 8) return memcmp(a, b, num_bytes);
+    uint64_t a_prefix = key_prefix(a, num_bytes), b_prefix = key_prefix(b, num_bytes);
+    return (a_prefix > b_prefix) - (a_prefix < b_prefix);
+}
+
+static inline size_t key_bucket_index(const uint8_t* hash, int num_prefix_bytes) { //Scale the prefix into [0, NUM_BUCKETS)
+    return (size_t)((key_prefix(hash, num_prefix_bytes) * NUM_BUCKETS) >> (num_prefix_bytes * 8));
+}
+
+static inline size_t key_count_unsorted(const Record* records, size_t count) { //Adjacent pairs out of order, no data dependent branches so the loop can vectorise
+    size_t unsorted = 0;
+    for (size_t i = 1; i < count; i++) {
+        unsorted += key_compare(records[i - 1].hash, records[i].hash) > 0;
+    }
+    return unsorted;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pos.h"
+#include "keys.h"
+
+//Record order inside a plot bucket. Sorted buckets are binary searched, which jumps across the whole bucket.
+//Eytzinger buckets hold the same records as an implicit search tree stored breadth first: slot k (counting
+//from 1) has its children at 2k and 2k + 1, so every search starts on the same few cache lines and walks
+//down with one branch free comparison per level. The layout is flagged per bucket in its count header.
+
+static inline size_t eytzinger_first(size_t count) { //Slot of the smallest record, 0 for an empty bucket
+    if (count == 0) return 0;
+    size_t k = 1;
+    while (2 * k <= count) k *= 2;
+    return k;
+}
+
+static inline size_t eytzinger_next(size_t k, size_t count) { //In order successor of slot k, 0 past the largest record
+    if (2 * k + 1 <= count) { //Leftmost slot of the right subtree
+        k = 2 * k + 1;
+        while (2 * k <= count) k *= 2;
+        return k;
+    }
+    return k >> (__builtin_ctzll(~(unsigned long long)k) + 1); //Climb while k is a right child, then once more
+}
+
+static inline void eytzinger_from_sorted(const Record* sorted, Record* out, size_t count) {
+    size_t rank = 0;
+    for (size_t k = eytzinger_first(count); k != 0; k = eytzinger_next(k, count)) {
+        out[k - 1] = sorted[rank++];
+    }
+}
+
+static inline void eytzinger_to_sorted(const Record* records, Record* out, size_t count) {
+    size_t rank = 0;
+    for (size_t k = eytzinger_first(count); k != 0; k = eytzinger_next(k, count)) {
+        out[rank++] = records[k - 1];
+    }
+}
+
+static inline size_t eytzinger_lower_bound(const Record* records, size_t count, const uint8_t* hash, int num_prefix_bytes) { //Slot of the first record whose prefix is not below hash, 0 if there is none
+    size_t k = 1;
+    while (k <= count) {
+        if (16 * k <= count) __builtin_prefetch(&records[16 * k - 1]); //Four levels down, the 16 descendants share a few lines
+        k = 2 * k + (key_compare_prefix(records[k - 1].hash, hash, num_prefix_bytes) < 0);
+    }
+    return k >> (__builtin_ctzll(~(unsigned long long)k) + 1); //Undo the right turns after the last left turn
+}
+
+static inline const Record* bucket_records_sorted(const uint8_t* bucket, size_t count, Record* scratch) { //The bucket's records in key order, in place when it is already sorted, else copied into scratch
+    const Record* records = (const Record*)(bucket + BUCKET_HEADER_SIZE);
+    if (decode_bucket_layout(bucket) == BUCKET_LAYOUT_SORTED) return records;
+    eytzinger_to_sorted(records, scratch, count);
+    return scratch;
+}
+
+#endif
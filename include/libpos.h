@@ -0,0 +1,35 @@
+#ifndef LIBPOS_H
+#define LIBPOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "../include/pos.h"
+#include "../include/hashgen.h"
+
+//In process API over the plot tools, built as libpos.a and libpos.so by `make libpos`.
+//Callers must build with the same K, B, R and COUNT_BITS as the library. Nothing here keeps global
+//state: a PosPlot can be shared by any number of threads as long as each passes its own PosScratch.
+
+typedef struct PosPlot PosPlot;
+typedef struct PosScratch PosScratch;
+
+PosPlot* pos_plot_open(const char* paths, bool use_filters, bool verify_reads); //Comma separated plots or stripes in bucket order, NULL on error
+int pos_plot_map(PosPlot* plot); //mmap the raw plot files so pos_lookup_batch searches them in place with interleaved prefetches, 0 on success
+void pos_plot_close(PosPlot* plot);
+
+PosScratch* pos_scratch_create(void); //Read buffer for one thread, lookups through it never allocate
+void pos_scratch_free(PosScratch* scratch);
+
+int pos_lookup(PosPlot* plot, PosScratch* scratch, const uint8_t* hash, int prefix_bytes, Record* found); //1 on a hit, 0 on a miss, -1 on an error
+size_t pos_lookup_batch(PosPlot* plot, PosScratch* scratch, const uint8_t (*hashes)[HASH_SIZE], size_t count, int prefix_bytes, Record* found, bool* hit); //Returns the hits, found[i] is only set where hit[i]. Runs LOOKUP_GROUP_SIZE queries interleaved over mapped plots
+
+int pos_generate(PlotOptions* options, ProgressCallback callback, void* user); //Same pipeline as hashgen, callback may be NULL
+
+ssize_t pos_verify_checksums(const char* path, int num_threads); //Buckets failing their .sums checksum, path may list the stripes in order, -1 on an error
+ssize_t pos_verify_sorted(const char* path, size_t* num_unsorted); //Records in the plot, -1 on an error
+size_t pos_verify_proofs(const Record* proofs, size_t count, bool* valid, int num_threads); //Proofs whose nonce does not hash to their hash, valid may be NULL
+int pos_digest(const char* path, uint8_t* digest); //BLAKE3_OUT_LEN byte digest of the whole file
+
+#endif
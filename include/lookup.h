@@ -1,21 +1,97 @@
 #ifndef LOOKUP_H
 #define LOOKUP_H
 
+#include <stdio.h>
+#include <stdbool.h>
+
 #include "pos.h"
+#include "filter.h"
+#include "pack.h"
+#include "checksum.h"
+#include "stats.h"
+#include "workload.h"
+
+typedef struct {
+    FILE* file;
+    size_t first_bucket; //First bucket of the plot that is stored in this file
+    size_t num_buckets;
+    uint8_t* touched; //Buckets read so far in this run, a first read counts as cold unless the set reads direct, then every read does
+    int direct_fd; //Second descriptor opened with O_DIRECT, -1 unless the plot set was opened for direct reads
+    PackedPlot* packed; //Set when the file is a packed plot, which always holds the whole plot
+    const uint8_t* map; //Whole stripe mapped read only by map_plot_set, NULL otherwise
+    size_t map_size;
+} PlotStripe;
+
+typedef enum {
+    COLD_NONE,
+    COLD_FADVISE, //Drop the plot from the page cache before the cold pass
+    COLD_DIRECT //Cold pass reads with O_DIRECT, bypassing the page cache
+} ColdMode;
+
+#define DIRECT_IO_ALIGN 4096
+
+typedef enum {
+    LOOKUP_AUTO, //Scan join once the batch is large against the plot, point lookups otherwise
+    LOOKUP_POINT,
+    LOOKUP_SCAN,
+    LOOKUP_MEMORY //Map the plots and run the queries interleaved, for plots that sit in RAM
+} LookupMode;
+
+#define LOOKUP_SCRATCH_SIZE ((BIG_BUCKET_SIZE > PACK_MAX_BUCKET_SIZE(RECORDS_BIG_BUCKET) ? BIG_BUCKET_SIZE : PACK_MAX_BUCKET_SIZE(RECORDS_BIG_BUCKET)) + 2 * DIRECT_IO_ALIGN) //One raw or packed bucket, with room to align a direct read
+#define SCAN_READ_SIZE (8 << 20) //Bytes per sequential read while scanning a plot
+#define SCAN_JOIN_MIN_FRACTION 0.25 //Scan once point lookups would read at least this share of the buckets
+#define LOOKUP_GROUP_SIZE 16 //Queries in flight per thread in the interleaved search, each with one probe prefetched
+#define LOOKUP_CHUNK_SIZE 4096 //Queries handed to a thread at a time by run_lookups_interleaved
+
+typedef struct { //I/O done on behalf of one lookup
+    uint64_t seeks;
+    uint64_t bytes_read;
+    bool cold;
+} LookupIO;
+
+typedef struct {
+    PlotStripe stripes[MAX_PATHS];
+    size_t num_stripes;
+    size_t plot_first_stripe[MAX_PATHS + 1]; //Stripes plot_first_stripe[p] up to plot_first_stripe[p + 1] make up plot p
+    size_t num_plots;
+    BucketFilter filters[MAX_PATHS]; //Per plot, loaded from the side file next to its first stripe
+    bool has_filter[MAX_PATHS];
+    BucketChecksums checksums[MAX_PATHS]; //Per plot from <plot>.sums, only loaded when reads are verified
+    bool has_checksums[MAX_PATHS];
+    bool direct; //Read through the direct descriptors
+} PlotSet;
 
 int hexchar_to_int(char c);
 
-Record* read_bucket(FILE* file, size_t bucket_index, uint16_t* out_count, int* num_seeks); //Seek a bucket
-Record* read_bucket_by_hash(FILE* file, const uint8_t* hash, int num_prefix_bytes, uint16_t* out_count, int* num_seeks); //Find bucket index via a prefix
-Record* search_records(FILE* file, const uint8_t* hash, int num_prefix_bytes, int* num_seeks); // Binary search through the combined buckets
+double run_lookups(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report); //Returns the elapsed ms
+double run_scan_join(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report); //Sort the queries, stream every plot once and merge join, returns the elapsed ms
+double run_lookups_interleaved(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report); //Point lookups through search_plot_set_many, map the plot set first, returns the elapsed ms
+bool prefer_scan_join(size_t num_queries); //Decides LOOKUP_AUTO from the batch size against the buckets in a plot
+int open_plot_set(PlotSet* set, char** paths, size_t num_paths, bool use_filters, bool open_direct, bool verify_reads); //Group the files in order into whole plots using their bucket counts
+void close_plot_set(PlotSet* set);
+int drop_plot_cache(const PlotSet* set); //posix_fadvise(DONTNEED) over every stripe
+int map_plot_set(PlotSet* set); //mmap every raw stripe, packed stripes keep being read, unmapped by close_plot_set
+Record* search_plot_set(const PlotSet* set, const uint8_t* hash, int num_prefix_bytes, LookupIO* io); //Query every plot on the stripe that owns the bucket
+int search_plot_set_into(const PlotSet* set, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, LookupIO* io); //Allocation free, reads into scratch and returns 1 on a hit, 0 on a miss, -1 on an error
+size_t search_plot_set_many(const PlotSet* set, const uint8_t (*hashes)[HASH_SIZE], size_t count, int num_prefix_bytes, uint8_t* scratch, Record* found, int8_t* status,
+                            LookupIO* io, uint64_t* latency_ns); //Same answers as search_plot_set_into per query in status, returns the hits. Mapped buckets are searched LOOKUP_GROUP_SIZE queries at a time with each next probe prefetched, io and latency_ns may be NULL
+uint8_t* lookup_scratch_alloc(void); //LOOKUP_SCRATCH_SIZE aligned bytes for the _into searches, one per thread, release with free()
+
+Record* read_bucket(FILE* file, size_t bucket_index, bucket_count_t* out_count, LookupIO* io); //Seek a bucket
+Record* read_bucket_by_hash(FILE* file, const uint8_t* hash, int num_prefix_bytes, bucket_count_t* out_count, LookupIO* io); //Find bucket index via a prefix
+Record* search_records(FILE* file, const uint8_t* hash, int num_prefix_bytes, LookupIO* io); // Binary search through the combined buckets
+Record* search_bucket(int fd, bool direct, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, const uint64_t* expected_sum, LookupIO* io);
+int search_bucket_into(int fd, bool direct, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, const uint64_t* expected_sum, uint8_t* scratch, Record* found, LookupIO* io);
+Record* read_bucket_fd(int fd, bool direct, size_t bucket_index, bucket_count_t* out_count, const uint64_t* expected_sum, LookupIO* io); //direct reads whole aligned blocks into an aligned buffer, a bucket that fails expected_sum is an error
+Record* search_packed_bucket(int fd, bool direct, const PackedPlot* packed, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, LookupIO* io); //Read one packed bucket and decode only the block the prefix falls in
+int search_packed_bucket_into(int fd, bool direct, const PackedPlot* packed, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, LookupIO* io);
+size_t bucket_index_for_hash(const uint8_t* hash, int num_prefix_bytes);
 
 int hexchar_to_int(char c); //Helper functions for testing
 int parse_hex_string(const char* hex_str, uint8_t* out_bytes, size_t byte_len);
 
 size_t calc_filesize(const char* filename);
 
-uint8_t* generate_random_hash(int prefix_bytes); //Random prefixes to search for
-
 void print_records(const Record* records, size_t count); 
 
 #endif
\ No newline at end of file
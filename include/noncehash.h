@@ -0,0 +1,13 @@
+#ifndef NONCEHASH_H
+#define NONCEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../include/pos.h"
+
+#define HASH_LANES 16 //Nonces hashed together, one per SIMD lane once the compiler vectorises the lane loops
+
+void hash_nonces_many(const Record* records, size_t count, uint8_t (*hashes)[HASH_SIZE]); //BLAKE3 of up to HASH_LANES nonces at once
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "pos.h"
+#include "filter.h"
+
+#define PACK_MAGIC "POSPACK1"
+#define PACK_BLOCK_RECORDS 64 //Records per independently decodable block
+#define PACK_HASH_BITS (HASH_SIZE * 8)
+#define PACK_NONCE_BITS K //Nonces are below 2^K so only K bits of each are kept
+#define PACK_DIR_ENTRY_SIZE 12 //u32 block offset inside the bucket, then the first 8 hash bytes of the block
+#define PACK_BUCKET_HEADER_SIZE 4 //u32 record count
+#define PACK_BLOCK_SIZE_AT(n, width) (1 + HASH_SIZE + (((n) - 1) * (width) + 7) / 8 + ((n) * PACK_NONCE_BITS + 7) / 8) //n records with deltas of the given width
+#define PACK_BLOCK_SIZE(n) PACK_BLOCK_SIZE_AT(n, PACK_HASH_BITS) //Worst case, every delta at full width
+#define PACK_MAX_BUCKET_SIZE(n) (PACK_BUCKET_HEADER_SIZE + (((n) + PACK_BLOCK_RECORDS - 1) / PACK_BLOCK_RECORDS) * (PACK_DIR_ENTRY_SIZE + PACK_BLOCK_SIZE(PACK_BLOCK_RECORDS)))
+
+typedef struct { //64 byte header, the packed buckets follow it in order and the offset index comes last
+    char magic[8];
+    uint32_t k;
+    uint32_t b;
+    uint32_t r;
+    uint32_t block_records;
+    uint64_t num_buckets;
+    uint64_t num_records;
+    uint64_t index_offset; //NUM_BUCKETS + 1 little endian u64 file offsets, bucket i spans [index[i], index[i + 1])
+    uint8_t reserved[16];
+} PackHeader;
+
+typedef struct {
+    PackHeader header;
+    uint64_t* bucket_offsets;
+} PackedPlot;
+
+size_t pack_bucket(const Record* records, size_t count, uint8_t* out); //Returns the packed size, out needs PACK_MAX_BUCKET_SIZE(count) bytes
+ssize_t unpack_bucket(const uint8_t* bucket, size_t size, Record* records); //Decodes every block into RECORDS_BIG_BUCKET records at most, returns the record count or -1 if the bucket is corrupt
+int pack_search(const uint8_t* bucket, size_t size, const uint8_t* hash, int num_prefix_bytes, Record* found); //Decodes only the block the prefix falls in, 1 if found, 0 if not, -1 if the bucket is corrupt
+
+int pack_plot(char** input_files, size_t num_inputs, const char* output_file, int num_threads); //Pack a raw plot given as its stripes
+int pack_open(PackedPlot* plot, FILE* file); //Returns 1 if the file is not a packed plot
+void pack_close(PackedPlot* plot);
+
+#endif
@@ -2,6 +2,8 @@
 #define POS_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include <math.h>
 
 #define HASH_SIZE 10
@@ -27,11 +29,36 @@
 
 
 #define PRINT_TIME 5
+#define INMEM_WRITE_SIZE (8 << 20) //Bytes of bucket images per write when plotting in memory
+
+#define MAX_PATHS 64 // Most output stripes or plots that can be given as a comma separated list
 
 #define NUM_BATCHES ((size_t)(NUM_RECORDS + NUM_BUCKETS * MAX_RECORDS_PER_BUCKET - 1) / (NUM_BUCKETS * MAX_RECORDS_PER_BUCKET))
 
 #define RECORDS_BIG_BUCKET (NUM_BATCHES * MAX_RECORDS_PER_BUCKET)
 
+#ifndef COUNT_BITS
+#define COUNT_BITS 16
+#endif
+
+#if COUNT_BITS == 32
+typedef uint32_t bucket_count_t;
+#define BUCKET_HEADER_SIZE 16 //The 4 byte count is padded to a whole record so every record sits on a 16 byte boundary
+#elif COUNT_BITS == 16
+typedef uint16_t bucket_count_t;
+#define BUCKET_HEADER_SIZE 2
+#else
+#error "COUNT_BITS must be 16 or 32"
+#endif
+#define MAX_BUCKET_COUNT ((1ULL << COUNT_BITS) - 1)
+#define BIG_BUCKET_SIZE (BUCKET_HEADER_SIZE + RECORDS_BIG_BUCKET * sizeof(Record))
+
+#define TEMP_HASH_SKIP ((int)(B / 8)) //Leading hash bytes a temp record leaves out, the bucket index holds them
+#define TEMP_OFFSET_SIZE ((int)((B + R + 7) / 8)) //A temp record stores its nonce as an offset from the batch's first nonce in this many bytes
+#define TEMP_RECORD_SIZE (HASH_SIZE - TEMP_HASH_SKIP + TEMP_OFFSET_SIZE)
+#define TEMP_BATCH_HEADER_SIZE (sizeof(TempBatchHeader) + (NUM_BUCKETS + 1) * sizeof(uint32_t)) //Header, then the offset table
+#define TEMP_BATCH_SIZE (TEMP_BATCH_HEADER_SIZE + NUM_BUCKETS * MAX_RECORDS_PER_BUCKET * TEMP_RECORD_SIZE) //Largest a batch can get, with every bucket full
+
 typedef struct { //total 16 bytes 
     uint8_t hash[HASH_SIZE]; // hash value as byte array 
     uint8_t nonce[NONCE_SIZE]; // Nonce value as byte array 
@@ -39,18 +66,108 @@ typedef struct { //total 16 bytes
 
 typedef struct {
     Record records[MAX_RECORDS_PER_BUCKET];
-    uint16_t record_count;
+    bucket_count_t record_count; //Once it reaches MAX_RECORDS_PER_BUCKET the records are a max-heap on nonce
 } Bucket;
 
-void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucket* buckets, size_t records_batch, double* last_print, size_t records_generated, bool debug); //generate the original buckets
+typedef struct { //In front of every batch in a temp file, followed by its offset table and the records of every bucket back to back, no padding
+    uint64_t first_nonce; //Nonce offsets in the batch count from here
+    uint64_t size; //Bytes of the batch including header and table, the next batch in the file starts right after
+} TempBatchHeader;
 
-int dump_buckets(Bucket* buckets, size_t num_buckets, const char* filename); //dump the original buckets into the temp file
+_Static_assert(B + R <= 32, "The offset table indexes a batch's records with 32 bits");
+_Static_assert(RECORDS_BIG_BUCKET <= MAX_BUCKET_COUNT, "Buckets hold more records than their count can store, build with COUNT_BITS=32 or a larger B");
 
+typedef enum { //Order of the records inside a plot bucket, see layout.h
+    BUCKET_LAYOUT_SORTED,
+    BUCKET_LAYOUT_EYTZINGER
+} BucketLayout;
+
+#define BUCKET_EYTZINGER_FLAG (1ULL << (COUNT_BITS - 1)) //Top bit of the count header, set on buckets stored in Eytzinger order
+#define EYTZINGER_SUPPORTED (RECORDS_BIG_BUCKET < BUCKET_EYTZINGER_FLAG) //Otherwise the bit is part of the count
+
+#define SHARD_MAGIC "POSSHRD1"
+#define SHARD_IO_BUFFER (4 << 20) //stdio buffer per shard so the merge reads and writes in large sequential chunks
+
+typedef struct { //64 byte header at the front of a shard file, the buckets follow in the usual layout
+    char magic[8];
+    uint64_t start_nonce; //first nonce hashed into this shard
+    uint64_t num_nonces;
+    uint32_t k;
+    uint32_t b;
+    uint32_t r;
+    uint32_t records_per_bucket; //capacity of every bucket in the shard
+    uint8_t reserved[24];
+} ShardHeader;
+
+struct BucketFilter; //filter.h
+struct BucketChecksums; //checksum.h
+
+typedef struct {
+    const char* stage; //HASHGEN, SORTMERGE or INMEM_SORT
+    const char* unit;
+    size_t done;
+    size_t total;
+    double mb_done;
+    double elapsed; //Seconds since the stage started
+    int count; //Reports made so far in this stage
+} ProgressInfo;
+
+typedef void (*ProgressCallback)(const ProgressInfo* info, void* user);
+
+typedef struct { //Owned by the caller, so the long running calls keep no state between runs
+    ProgressCallback callback; //NULL for no reports
+    void* user;
+    double start_time;
+    double last_report;
+    int count;
+} Progress;
+
+void progress_init(Progress* progress, ProgressCallback callback, void* user); //Starts the clock for a new stage
+void progress_update(Progress* progress, const char* stage, const char* unit, size_t done, size_t total, double mb_done); //Calls back at most every PRINT_TIME seconds, callers serialise it
+void progress_print(const ProgressInfo* info, void* user); //Callback that prints the usual [n][STAGE] line
+
+void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucket* buckets, size_t records_batch, size_t records_generated, Progress* progress); //generate the original buckets, progress may be NULL
+
+int dump_buckets(Bucket* buckets, size_t num_buckets, uint64_t first_nonce, const char* filename, long offset, int num_threads_write, size_t* batch_size); //dump the original buckets as a compact batch into the preallocated temp file at offset, each writer thread takes a range of buckets, batch_size gets the bytes written
+
+void encode_bucket_count(uint8_t* header, size_t count); //Fills BUCKET_HEADER_SIZE bytes, little endian count then zeros
+size_t decode_bucket_count(const uint8_t* header); //Records in the bucket, without the layout flag
+void encode_bucket_header(uint8_t* header, size_t count, BucketLayout layout); //Count with the layout flag
+BucketLayout decode_bucket_layout(const uint8_t* header);
+int write_bucket_count(FILE* file, size_t count);
+int write_bucket_header(FILE* file, size_t count, BucketLayout layout);
 void increment_nonce(uint8_t *nonce, size_t nonce_size); //helper function for incrementing the nonce
 
 int compare_records(const void* a, const void* b);
-void merge_and_sort_buckets(const char* input_file, const char* output_file, int num_threads_sort); //Gather all the buckets from the temp file and then sort and dump into the output file
-void sort_buckets_in_memory(Bucket* buckets, const char* output_file);
+void sort_records_by_key(const Record* records, size_t count, Record* sorted, uint64_t* keys); //Sort 8 byte keys with an index then permute the records once, keys must hold count entries
+int merge_and_sort_buckets(char** input_files, size_t num_inputs, char** output_files, size_t num_outputs, size_t num_batches, const ShardHeader* shard, struct BucketFilter* filter, struct BucketChecksums* checksums, BucketLayout layout, int num_threads_sort, Progress* progress); //Gather all the buckets from the temp files and then sort and dump into the output stripes, with a shard header in front if given, -1 if any bucket could not be read or written
+size_t image_buckets(size_t image_bytes); //Whole buckets per write image of about image_bytes, at least one and never more than the plot
+size_t in_memory_plot_mb(uint64_t num_nonces, int num_threads); //Memory generate_plot_in_memory needs
+size_t recompute_min_mb(int num_threads_hash, int num_threads_sort); //Smallest -m that fits one bucket per pass
+size_t recompute_pass_records(int memory_mb, int num_threads_hash, int num_threads_sort, size_t* chunk_buckets); //Records one generate_plot_in_passes pass can hold within memory_mb, 0 if not even one bucket fits. Sets the buckets per sort thread write image
+int generate_plot_in_passes(uint64_t start_nonce, uint64_t num_nonces, char** output_files, size_t num_outputs, struct BucketFilter* filter, struct BucketChecksums* checksums, BucketLayout layout,
+                            size_t max_pass_records, size_t chunk_buckets, int num_threads_hash, int num_threads_sort, Progress* progress, size_t* num_passes); //Count, then per range of buckets holding at most max_pass_records hash every nonce again, keep the range in RAM, sort and append it to the plot chunk_buckets at a time
+int generate_plot_in_memory(uint64_t start_nonce, uint64_t num_nonces, char** output_files, size_t num_outputs, struct BucketFilter* filter, struct BucketChecksums* checksums, BucketLayout layout, int num_threads_hash, int num_threads_sort, Progress* progress); //Count, then scatter every record into one exact size arena, sort and write the plot without a temp file
+
+int preallocate_file(FILE* file, off_t size); //fallocate the whole file up front, or make it sparse where that is not supported
+int skip_padding(FILE* file, size_t num_records); //Seek over empty slots instead of writing zeros, they read back as zeros
+int open_output_stripes(char** output_files, size_t num_outputs, size_t bucket_size, size_t header_size, FILE** outputs);
+
+size_t split_paths(char* list, char** paths, size_t max_paths); //Split a comma separated list of paths in place
+size_t temp_batches_in_file(size_t file_index, size_t num_temp_files, size_t num_batches); //Batches are dealt round robin, so batch b lives in temp file b % num_temp_files
+int make_temp_paths(char** dirs, size_t num_dirs, char** temp_files); //One temp file per scratch directory
+void free_temp_paths(char** temp_files, size_t num_temp_files);
+size_t stripe_first_bucket(size_t stripe, size_t num_stripes); //First bucket stored in a stripe when a plot is spread across num_stripes files
+size_t stripe_of_bucket(size_t bucket_index, size_t num_stripes);
+size_t stripe_chunk_order(size_t first_bucket, size_t end_bucket, size_t chunk_buckets, size_t num_stripes, size_t* chunks); //First buckets of the range's chunks dealt round robin across the stripes, so consecutive writes go to different devices while each stripe still gets its buckets in order. chunks needs (end - first) / chunk_buckets + num_stripes + 1 entries, returns how many
+size_t stripe_chunk_end(size_t chunk_first, size_t end_bucket, size_t chunk_buckets, size_t num_stripes); //End of the chunk starting at chunk_first, chunks never cross a stripe
+
+void nonce_from_u64(uint64_t value, uint8_t* nonce); //Nonces are stored little endian
+uint64_t nonce_to_u64(const uint8_t* nonce);
+void init_shard_header(ShardHeader* header, uint64_t start_nonce, uint64_t num_nonces, size_t num_batches);
+int read_shard_header(FILE* file, ShardHeader* header); //Check the magic and that the shard was built with this K, B and R
+int read_plot_as_shard(FILE* file, const char* filename, ShardHeader* header); //A headerless plot from a smaller K, bucket capacity taken from the file size and the nonce count from its .sums
+int merge_shards(char** shard_files, size_t num_shards, char** output_files, size_t num_outputs, struct BucketFilter* filter, struct BucketChecksums* checksums, BucketLayout layout); //k-way merge sorted shards, or plots from a smaller K in either layout, bucket by bucket into one plot
 
 int calc_max_records_per_bucket(size_t memory_mb);
 int calc_prefix_bytes(size_t num_buckets);
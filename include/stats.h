@@ -0,0 +1,39 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define HIST_SUB_BUCKETS 32 //Linear steps per power of two, values are kept to about 3% precision
+#define HIST_SIZE (60 * HIST_SUB_BUCKETS)
+
+typedef struct { //HDR style log-linear histogram of nanosecond latencies
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} LatencyHistogram;
+
+typedef struct {
+    LatencyHistogram all;
+    LatencyHistogram cold; //Lookups that read at least one bucket for the first time in this run
+    LatencyHistogram warm;
+    uint64_t found;
+    uint64_t seeks;
+    uint64_t bytes_read;
+} LookupReport;
+
+void hist_init(LatencyHistogram* hist);
+void hist_record(LatencyHistogram* hist, uint64_t value_ns);
+void hist_merge(LatencyHistogram* dst, const LatencyHistogram* src);
+uint64_t hist_percentile(const LatencyHistogram* hist, double percentile); //Upper edge of the bucket holding the percentile
+
+void report_init(LookupReport* report);
+void report_record(LookupReport* report, uint64_t latency_ns, bool cold, bool found, uint64_t seeks, uint64_t bytes_read);
+void report_merge(LookupReport* dst, const LookupReport* src);
+void report_print(const LookupReport* report, double elapsed_ms);
+int report_write_json(const LookupReport* reports, const char* const* names, const double* elapsed_ms, size_t num_reports, const char* filename); //More than one report nests each under its name
+
+#endif
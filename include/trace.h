@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <omp.h>
+
+//Timeline tracing, compiled in with `make TRACE=1` (-DPOS_TRACE). Each thread records spans into its own
+//ring of TRACE_RING_EVENTS, the oldest are overwritten, and trace_write dumps every ring as Chrome
+//trace-event JSON for Perfetto or chrome://tracing. Without POS_TRACE the macros expand to nothing.
+
+#define TRACE_RING_EVENTS (1 << 16) //Spans kept per thread
+
+int trace_write(const char* filename); //Returns -1 when tracing is compiled out or the file cannot be written
+
+#ifdef POS_TRACE
+
+uint64_t trace_now(void); //CLOCK_MONOTONIC in ns
+void trace_span(const char* name, uint64_t start_ns, uint64_t end_ns); //name must outlive the trace, string literals only
+
+#define TRACE_BEGIN(span) uint64_t span##_trace_start = trace_now()
+#define TRACE_END(span, name) trace_span(name, span##_trace_start, trace_now())
+#define TRACE_SET_LOCK(lock, name) do { /*Only a contended lock costs a span*/ \
+        if (!omp_test_lock(lock)) { \
+            uint64_t lock_wait_start = trace_now(); \
+            omp_set_lock(lock); \
+            trace_span(name, lock_wait_start, trace_now()); \
+        } \
+    } while (0)
+
+#else
+
+#define TRACE_BEGIN(span) do { } while (0)
+#define TRACE_END(span, name) do { } while (0)
+#define TRACE_SET_LOCK(lock, name) omp_set_lock(lock)
+
+#endif
+
+#endif
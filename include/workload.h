@@ -0,0 +1,43 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "pos.h"
+
+#define TRACE_HEADER "# vault trace prefix_bytes="
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_HOTSPOT, //hot_weight of the queries go to the first hot_fraction of the keys
+    DIST_ZIPF
+} Distribution;
+
+typedef struct {
+    Distribution distribution;
+    uint64_t seed;
+    double hit_ratio; //Share of queries built from a real nonce, the rest are random prefixes
+    double hot_fraction;
+    double hot_weight;
+    double zipf_s;
+    uint64_t key_space; //Distinct keys the distribution picks from, key i is nonce i for hits
+} WorkloadConfig;
+
+typedef struct {
+    uint8_t (*queries)[HASH_SIZE]; //One zero padded prefix per query, made before anything is timed
+    size_t count;
+    int prefix_bytes;
+    size_t expected_hits;
+} Workload;
+
+void workload_defaults(WorkloadConfig* config);
+int parse_distribution(const char* spec, WorkloadConfig* config); //uniform, hotspot[:fraction[:weight]] or zipf[:s]
+
+int workload_generate(Workload* workload, const WorkloadConfig* config, size_t count, int prefix_bytes);
+int workload_save(const Workload* workload, const char* filename); //One hex prefix per line
+int workload_load(Workload* workload, const char* filename);
+void workload_free(Workload* workload);
+
+#endif
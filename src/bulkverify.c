@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <omp.h>
+
+#include "../include/pos.h"
+#include "../include/keys.h"
+#include "../include/noncehash.h"
+#include "../include/bulkverify.h"
+
+size_t verify_records_bulk(const Record* records, size_t count, bool* valid, int num_threads) {
+    size_t failed = 0;
+    size_t num_groups = (count + HASH_LANES - 1) / HASH_LANES;
+
+    #pragma omp parallel for num_threads(num_threads) schedule(static) reduction(+:failed)
+    for (size_t g = 0; g < num_groups; g++) {
+        uint8_t hashes[HASH_LANES][HASH_SIZE];
+        size_t first = g * HASH_LANES;
+        size_t in_group = count - first < HASH_LANES ? count - first : HASH_LANES;
+
+        hash_nonces_many(&records[first], in_group, hashes);
+        for (size_t l = 0; l < in_group; l++) {
+            bool ok = key_equal(hashes[l], records[first + l].hash);
+            if (valid) valid[first + l] = ok;
+            failed += !ok;
+        }
+    }
+    return failed;
+}
+
+ssize_t verify_proof_file(const char* filename, int num_threads, size_t* num_proofs) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        perror("Failed to open proof file");
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, SHARD_IO_BUFFER);
+
+    Record* chunk = malloc(PROOF_CHUNK_RECORDS * sizeof(Record));
+    bool* valid = malloc(PROOF_CHUNK_RECORDS * sizeof(bool));
+    if (!chunk || !valid) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(chunk);
+        free(valid);
+        fclose(file);
+        return -1;
+    }
+
+    size_t total = 0;
+    size_t failed = 0;
+    size_t got;
+    while ((got = fread(chunk, sizeof(Record), PROOF_CHUNK_RECORDS, file)) > 0) {
+        size_t chunk_failed = verify_records_bulk(chunk, got, valid, num_threads);
+
+        for (size_t i = 0; i < got && chunk_failed > 0; i++) { //Name the first few bad proofs, the count covers the rest
+            if (valid[i]) continue;
+            chunk_failed--;
+            if (failed < MAX_REPORTED_FAILURES) {
+                fprintf(stderr, "Proof %zu with nonce %lu does not match its hash\n", total + i, (unsigned long)nonce_to_u64(chunk[i].nonce));
+            }
+            failed++;
+        }
+        total += got;
+    }
+
+    bool read_error = ferror(file);
+    if (read_error) {
+        perror("Failed to read proof file");
+    } else if (!feof(file) || total * sizeof(Record) != (size_t)ftell(file)) {
+        fprintf(stderr, "Proof file ends in a partial record\n");
+        read_error = true;
+    }
+
+    free(chunk);
+    free(valid);
+    fclose(file);
+    if (num_proofs) *num_proofs = total;
+    return read_error ? -1 : (ssize_t)failed;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <omp.h>
+
+#include "../include/pos.h"
+#include "../include/calibrate.h"
+
+typedef double (*ProbeFn)(Bucket* buckets, const char* temp_file, int num_threads); //Returns MB/s
+
+static double probe_hash(Bucket* buckets, const char* temp_file, int num_threads) {
+    (void)temp_file;
+    uint8_t nonce[NONCE_SIZE] = {0};
+    size_t records = 0;
+
+    omp_set_num_threads(num_threads);
+    double start = omp_get_wtime();
+    do {
+        generate_records(nonce, calc_prefix_bytes(NUM_BUCKETS), buckets, NUM_BUCKETS * MAX_RECORDS_PER_BUCKET, 0, NULL);
+        records += NUM_BUCKETS * MAX_RECORDS_PER_BUCKET;
+    } while (omp_get_wtime() - start < CALIBRATE_MIN_SECONDS);
+
+    return records * sizeof(Record) / 1e6 / (omp_get_wtime() - start);
+}
+
+static double probe_sort(Bucket* buckets, const char* temp_file, int num_threads) {
+    (void)temp_file;
+    size_t records = 0;
+    int failed = 0;
+
+    double start = omp_get_wtime();
+    do {
+        #pragma omp parallel num_threads(num_threads) reduction(|:failed)
+        {
+            Record* sorted = malloc(MAX_RECORDS_PER_BUCKET * sizeof(Record));
+            uint64_t* keys = malloc(MAX_RECORDS_PER_BUCKET * sizeof(uint64_t));
+            failed |= !sorted || !keys;
+
+            #pragma omp for schedule(static, 1)
+            for (size_t b = 0; b < NUM_BUCKETS; b++) { //The hashed batch is left unsorted so every round sorts the same input
+                if (sorted && keys) sort_records_by_key(buckets[b].records, buckets[b].record_count, sorted, keys);
+            }
+
+            free(sorted);
+            free(keys);
+        }
+        for (size_t b = 0; b < NUM_BUCKETS; b++) {
+            records += buckets[b].record_count;
+        }
+    } while (!failed && omp_get_wtime() - start < CALIBRATE_MIN_SECONDS);
+
+    if (failed) {
+        fprintf(stderr, "Memory allocation failed in the sort probe\n");
+        return 0;
+    }
+    return records * sizeof(Record) / 1e6 / (omp_get_wtime() - start);
+}
+
+static double probe_write(Bucket* buckets, const char* temp_file, int num_threads) {
+    size_t bytes = 0;
+
+    double start = omp_get_wtime();
+    do {
+        size_t batch_size = 0;
+        if (dump_buckets(buckets, NUM_BUCKETS, 0, temp_file, 0, num_threads, &batch_size) != 0) {
+            return 0;
+        }
+        FILE* file = fopen(temp_file, "r+b"); //Count the time to get the batch onto the device, not just into the page cache
+        if (!file) {
+            perror("Failed to open the write probe file");
+            return 0;
+        }
+        fsync(fileno(file));
+        fclose(file);
+        bytes += batch_size;
+    } while (omp_get_wtime() - start < CALIBRATE_MIN_SECONDS);
+
+    return bytes / 1e6 / (omp_get_wtime() - start);
+}
+
+static int pick_threads(const char* name, ProbeFn probe, Bucket* buckets, const char* temp_file, int max_threads) {
+    double rates[32];
+    int counts[32];
+    size_t num_rates = 0;
+    double best = 0;
+
+    for (int t = 1; num_rates < 32; t *= 2) { //Powers of two up to max_threads, then max_threads itself
+        if (t > max_threads) t = max_threads;
+        counts[num_rates] = t;
+        rates[num_rates] = probe(buckets, temp_file, t);
+        printf("[CALIBRATE] %-5s %3d threads: %.1f MB/s\n", name, t, rates[num_rates]);
+        fflush(stdout);
+        if (rates[num_rates] > best) best = rates[num_rates];
+        num_rates++;
+        if (t == max_threads) break;
+    }
+
+    for (size_t i = 0; i < num_rates; i++) { //Extra threads that buy almost nothing are better left to the other stages
+        if (rates[i] >= best * CALIBRATE_KEEP) return counts[i];
+    }
+    return 1;
+}
+
+int calibrate(const char* scratch_dir, int max_threads, TuningProfile* profile) {
+    if (max_threads < 1) max_threads = 1;
+
+    char temp_file[4096];
+    snprintf(temp_file, sizeof(temp_file), "%s/calibrate.bin", scratch_dir);
+
+    FILE* out = fopen(temp_file, "wb");
+    if (!out) {
+        perror("Failed to open the write probe file");
+        return -1;
+    }
+    if (preallocate_file(out, TEMP_BATCH_SIZE) != 0) {
+        perror("Failed to preallocate the write probe file");
+        fclose(out);
+        remove(temp_file);
+        return -1;
+    }
+    fclose(out);
+
+    Bucket* buckets = calloc(NUM_BUCKETS, sizeof(Bucket)); //One real batch, so every probe sees the memory footprint of a real run
+    if (!buckets) {
+        fprintf(stderr, "Failed to allocate memory for buckets\n");
+        remove(temp_file);
+        return -1;
+    }
+
+    profile->num_threads_hash = pick_threads("hash", probe_hash, buckets, temp_file, max_threads);
+    profile->num_threads_sort = pick_threads("sort", probe_sort, buckets, temp_file, max_threads);
+    profile->num_threads_write = pick_threads("write", probe_write, buckets, temp_file, max_threads);
+
+    free(buckets);
+    if (remove(temp_file) != 0) {
+        perror("Failed to remove the write probe file");
+    }
+    return 0;
+}
+
+int profile_save(const TuningProfile* profile, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open profile");
+        return -1;
+    }
+
+    fprintf(file, "# hashgen calibration, only builds with the same geometry load it\n");
+    fprintf(file, "K=%d\nB=%d\nR=%d\n", (int)K, (int)B, (int)R);
+    fprintf(file, "NUM_THREADS_HASH=%d\n", profile->num_threads_hash);
+    fprintf(file, "NUM_THREADS_SORT=%d\n", profile->num_threads_sort);
+    fprintf(file, "NUM_THREADS_WRITE=%d\n", profile->num_threads_write);
+
+    fclose(file);
+    return 0;
+}
+
+int profile_load(TuningProfile* profile, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    TuningProfile loaded = *profile;
+    int k = -1, b = -1, r = -1;
+    char line[256];
+    int value;
+    while (fgets(line, sizeof(line), file)) { //Unknown keys and comments are skipped so older binaries can read newer profiles
+        if (sscanf(line, "NUM_THREADS_HASH=%d", &value) == 1 && value > 0) loaded.num_threads_hash = value;
+        else if (sscanf(line, "NUM_THREADS_SORT=%d", &value) == 1 && value > 0) loaded.num_threads_sort = value;
+        else if (sscanf(line, "NUM_THREADS_WRITE=%d", &value) == 1 && value > 0) loaded.num_threads_write = value;
+        else if (sscanf(line, "K=%d", &value) == 1) k = value;
+        else if (sscanf(line, "B=%d", &value) == 1) b = value;
+        else if (sscanf(line, "R=%d", &value) == 1) r = value;
+    }
+    fclose(file);
+
+    if (k != (int)K || b != (int)B || r != (int)R) { //Batch size and bucket count change what the threads compete for, so the counts do not carry over
+        fprintf(stderr, "Ignoring profile %s, it was calibrated for K=%d B=%d R=%d and this build has K=%d B=%d R=%d, rerun with -c true\n",
+                filename, k, b, r, (int)K, (int)B, (int)R);
+        return 1;
+    }
+    *profile = loaded;
+    return 0;
+}
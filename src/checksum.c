@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "../BLAKE3/c/blake3.h"
+#include "../include/checksum.h"
+
+int checksums_init(BucketChecksums* checksums) {
+    memset(&checksums->header, 0, sizeof(ChecksumHeader));
+    memcpy(checksums->header.magic, CHECKSUM_MAGIC, sizeof(checksums->header.magic));
+    checksums->header.num_buckets = NUM_BUCKETS;
+    checksums->header.bucket_size = BIG_BUCKET_SIZE;
+
+    checksums->sums = calloc(NUM_BUCKETS, sizeof(uint64_t));
+    if (!checksums->sums) {
+        fprintf(stderr, "Failed to allocate memory for the checksums\n");
+        return -1;
+    }
+    return 0;
+}
+
+void checksums_free(BucketChecksums* checksums) {
+    free(checksums->sums);
+    checksums->sums = NULL;
+}
+
+static uint64_t finalize_checksum(blake3_hasher* hasher) {
+    uint8_t digest[8];
+    blake3_hasher_finalize(hasher, digest, sizeof(digest));
+
+    uint64_t sum = 0;
+    for (int i = 7; i >= 0; i--) {
+        sum = (sum << 8) | digest[i];
+    }
+    return sum;
+}
+
+uint64_t bucket_checksum(const uint8_t* bucket, size_t size) {
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, bucket, size);
+    return finalize_checksum(&hasher);
+}
+
+void checksums_add_bucket(BucketChecksums* checksums, size_t bucket_index, const Record* records, size_t count, BucketLayout layout) {
+    static const uint8_t zeros[4096]; //Padding is skipped over in preallocated files, so it reads back as zeros
+    uint8_t count_bytes[BUCKET_HEADER_SIZE];
+    encode_bucket_header(count_bytes, count, layout);
+
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, count_bytes, sizeof(count_bytes));
+    blake3_hasher_update(&hasher, records, count * sizeof(Record));
+
+    size_t padding = checksums->header.bucket_size - sizeof(count_bytes) - count * sizeof(Record);
+    while (padding > 0) {
+        size_t chunk = padding < sizeof(zeros) ? padding : sizeof(zeros);
+        blake3_hasher_update(&hasher, zeros, chunk);
+        padding -= chunk;
+    }
+
+    checksums->sums[bucket_index] = finalize_checksum(&hasher);
+}
+
+bool checksums_match(const BucketChecksums* checksums, size_t bucket_index, const uint8_t* bucket) {
+    return bucket_checksum(bucket, checksums->header.bucket_size) == checksums->sums[bucket_index];
+}
+
+static char* checksums_path(const char* plot_filename) {
+    size_t len = strlen(plot_filename) + strlen(CHECKSUM_SUFFIX) + 1;
+    char* path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s%s", plot_filename, CHECKSUM_SUFFIX);
+    }
+    return path;
+}
+
+int checksums_save(const BucketChecksums* checksums, const char* plot_filename) {
+    char* path = checksums_path(plot_filename);
+    if (!path) return -1;
+
+    FILE* file = fopen(path, "wb");
+    free(path);
+    if (!file) {
+        perror("Failed to open checksum file");
+        return -1;
+    }
+
+    if (fwrite(&checksums->header, sizeof(ChecksumHeader), 1, file) != 1 ||
+        fwrite(checksums->sums, sizeof(uint64_t), checksums->header.num_buckets, file) != checksums->header.num_buckets) {
+        perror("Failed to write checksum file");
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int checksums_read_header(const char* plot_filename, ChecksumHeader* header) {
+    char* path = checksums_path(plot_filename);
+    if (!path) return -1;
+
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (!file) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    int status = 0;
+    if (fread(header, sizeof(ChecksumHeader), 1, file) != 1 || memcmp(header->magic, CHECKSUM_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Checksum file for %s is not a checksum file\n", plot_filename);
+        status = -1;
+    }
+    fclose(file);
+    return status;
+}
+
+int checksums_load(BucketChecksums* checksums, const char* plot_filename) {
+    char* path = checksums_path(plot_filename);
+    if (!path) return -1;
+
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (!file) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    if (fread(&checksums->header, sizeof(ChecksumHeader), 1, file) != 1 ||
+        memcmp(checksums->header.magic, CHECKSUM_MAGIC, sizeof(checksums->header.magic)) != 0 ||
+        checksums->header.num_buckets != NUM_BUCKETS || checksums->header.bucket_size != BIG_BUCKET_SIZE) {
+        fprintf(stderr, "Checksum file for %s does not match this plot\n", plot_filename);
+        fclose(file);
+        return -1;
+    }
+
+    checksums->sums = malloc(NUM_BUCKETS * sizeof(uint64_t));
+    if (!checksums->sums) {
+        fprintf(stderr, "Failed to allocate memory for the checksums\n");
+        fclose(file);
+        return -1;
+    }
+
+    if (fread(checksums->sums, sizeof(uint64_t), NUM_BUCKETS, file) != NUM_BUCKETS) {
+        fprintf(stderr, "Checksum file for %s is truncated\n", plot_filename);
+        checksums_free(checksums);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
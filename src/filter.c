@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "../include/filter.h"
+#include "../include/keys.h"
+
+static uint64_t mix64(uint64_t x) { //The hashes are already BLAKE3 output, this only spreads the prefix over all 64 bits
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t filter_key(const uint8_t* hash, uint32_t prefix_bytes) {
+    return mix64(key_prefix(hash, prefix_bytes));
+}
+
+static uint64_t* filter_block(const BucketFilter* filter, size_t bucket_index, uint64_t key) {
+    uint64_t block = ((key >> 32) * filter->header.blocks_per_bucket) >> 32;
+    return &filter->blocks[(bucket_index * filter->header.blocks_per_bucket + block) * FILTER_BLOCK_WORDS];
+}
+
+int default_filter_prefix_bytes(void) {
+    int bytes = (K + 6 + 7) / 8; //At least 64 times more prefixes than records
+    return bytes > FILTER_MAX_PREFIX_BYTES ? FILTER_MAX_PREFIX_BYTES : bytes;
+}
+
+int filter_init(BucketFilter* filter, int bits_per_key, int prefix_bytes, size_t records_per_bucket) {
+    if (bits_per_key < 1 || bits_per_key > FILTER_MAX_BITS_PER_KEY || prefix_bytes < 1 || prefix_bytes > FILTER_MAX_PREFIX_BYTES) {
+        fprintf(stderr, "Invalid filter settings: %d bits per key, %d prefix bytes\n", bits_per_key, prefix_bytes);
+        return -1;
+    }
+
+    memset(&filter->header, 0, sizeof(FilterHeader));
+    memcpy(filter->header.magic, FILTER_MAGIC, sizeof(filter->header.magic));
+    filter->header.prefix_bytes = prefix_bytes;
+    filter->header.bits_per_key = bits_per_key;
+    filter->header.num_probes = (uint32_t)(bits_per_key * 0.69 + 0.5); //k = bits * ln 2 minimises the false positive rate
+    if (filter->header.num_probes < 1) filter->header.num_probes = 1;
+    if (filter->header.num_probes > 16) filter->header.num_probes = 16;
+    filter->header.blocks_per_bucket = FILTER_BLOCKS_FOR((size_t)bits_per_key, records_per_bucket);
+    filter->header.num_buckets = NUM_BUCKETS;
+
+    filter->blocks = calloc(NUM_BUCKETS * filter->header.blocks_per_bucket * FILTER_BLOCK_WORDS, sizeof(uint64_t));
+    if (!filter->blocks) {
+        fprintf(stderr, "Failed to allocate memory for the filter\n");
+        return -1;
+    }
+    return 0;
+}
+
+void filter_free(BucketFilter* filter) {
+    free(filter->blocks);
+    filter->blocks = NULL;
+}
+
+void filter_add_bucket(BucketFilter* filter, size_t bucket_index, const Record* records, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = filter_key(records[i].hash, filter->header.prefix_bytes);
+        uint64_t* block = filter_block(filter, bucket_index, key);
+
+        uint32_t h1 = (uint32_t)key; //The low half picks bits, the high half already picked the block
+        uint32_t h2 = (uint32_t)(key >> 23) | 1;
+        for (uint32_t p = 0; p < filter->header.num_probes; p++) {
+            uint32_t bit = (h1 + p * h2) & 511;
+            block[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+}
+
+bool filter_may_contain(const BucketFilter* filter, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes) {
+    if (num_prefix_bytes < (int)filter->header.prefix_bytes) { //Shorter queries than what was inserted cannot be answered by the filter
+        return true;
+    }
+
+    uint64_t key = filter_key(hash, filter->header.prefix_bytes);
+    const uint64_t* block = filter_block(filter, bucket_index, key);
+
+    uint32_t h1 = (uint32_t)key;
+    uint32_t h2 = (uint32_t)(key >> 23) | 1;
+    for (uint32_t p = 0; p < filter->header.num_probes; p++) {
+        uint32_t bit = (h1 + p * h2) & 511;
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static char* filter_path(const char* plot_filename) {
+    size_t len = strlen(plot_filename) + strlen(FILTER_SUFFIX) + 1;
+    char* path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s%s", plot_filename, FILTER_SUFFIX);
+    }
+    return path;
+}
+
+int filter_save(const BucketFilter* filter, const char* plot_filename) {
+    char* path = filter_path(plot_filename);
+    if (!path) return -1;
+
+    FILE* file = fopen(path, "wb");
+    free(path);
+    if (!file) {
+        perror("Failed to open filter file");
+        return -1;
+    }
+
+    size_t num_words = filter->header.num_buckets * filter->header.blocks_per_bucket * FILTER_BLOCK_WORDS;
+    if (fwrite(&filter->header, sizeof(FilterHeader), 1, file) != 1 ||
+        fwrite(filter->blocks, sizeof(uint64_t), num_words, file) != num_words) {
+        perror("Failed to write filter file");
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int filter_load(BucketFilter* filter, const char* plot_filename) {
+    char* path = filter_path(plot_filename);
+    if (!path) return -1;
+
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (!file) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    if (fread(&filter->header, sizeof(FilterHeader), 1, file) != 1 ||
+        memcmp(filter->header.magic, FILTER_MAGIC, sizeof(filter->header.magic)) != 0 ||
+        filter->header.num_buckets != NUM_BUCKETS ||
+        filter->header.prefix_bytes < 1 || filter->header.prefix_bytes > FILTER_MAX_PREFIX_BYTES || //key_prefix shifts by 8 bits per byte
+        filter->header.num_probes < 1 || filter->header.num_probes > 16 ||
+        filter->header.blocks_per_bucket == 0 || filter->header.blocks_per_bucket > FILTER_BLOCKS_FOR((size_t)FILTER_MAX_BITS_PER_KEY, RECORDS_BIG_BUCKET)) { //The block count sizes the allocation below
+        fprintf(stderr, "Filter file for %s does not match this plot\n", plot_filename);
+        fclose(file);
+        return -1;
+    }
+
+    size_t num_words = filter->header.num_buckets * filter->header.blocks_per_bucket * FILTER_BLOCK_WORDS;
+    filter->blocks = malloc(num_words * sizeof(uint64_t));
+    if (!filter->blocks) {
+        fprintf(stderr, "Failed to allocate memory for the filter\n");
+        fclose(file);
+        return -1;
+    }
+
+    if (fread(filter->blocks, sizeof(uint64_t), num_words, file) != num_words) {
+        fprintf(stderr, "Filter file for %s is truncated\n", plot_filename);
+        filter_free(filter);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <getopt.h>
 
 #include <omp.h>
@@ -13,24 +15,65 @@
 
 #include "../BLAKE3/c/blake3.h"
 #include "../include/pos.h"
+#include "../include/filter.h"
+#include "../include/checksum.h"
+#include "../include/calibrate.h"
+#include "../include/hashgen.h"
+#include "../include/trace.h"
+
+#ifndef POS_LIBRARY
 
 int main(int argc, char* argv[]) {
 
-    char* filename = "buckets.bin";
+    char default_filename[] = "buckets.bin";
+    char* filename = default_filename;
+    char default_scratch[] = ".";
+    char* scratch = default_scratch;
     bool debug = false;
+    int filter_bits_per_key = 0;
+    int filter_prefix_bytes = default_filter_prefix_bytes();
     int memory_mb = 16;
     int file_size_mb = 1024;
-    int num_threads_hash = 1;
-    int num_threads_sort = 1;
-    int num_threads_write = 1;
+    int num_threads_hash = 0; //0 until set by a flag or the profile
+    int num_threads_sort = 0;
+    int num_threads_write = 0;
+    bool calibrate_mode = false;
+    char* profile_file = DEFAULT_PROFILE;
     bool in_memory = false;
+    bool recompute = false;
+    uint64_t start_nonce = 0;
+    uint64_t num_nonces = 0;
+    char* extend_file = NULL;
+    BucketLayout layout = BUCKET_LAYOUT_SORTED;
+    char* trace_file = NULL;
     int opt;
 
-    while (( opt = getopt(argc, argv, "f:d:m:s:t:o:i:k:h")) != -1) {
+    while (( opt = getopt(argc, argv, "f:T:a:n:e:b:p:L:d:m:s:t:o:i:k:R:c:P:x:h")) != -1) {
         switch (opt) {
             case 'f':
                 filename = optarg;
                 break;
+            case 'T':
+                scratch = optarg;
+                break;
+            case 'a':
+                start_nonce = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_nonces = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                extend_file = optarg;
+                break;
+            case 'b':
+                filter_bits_per_key = atoi(optarg);
+                break;
+            case 'p':
+                filter_prefix_bytes = atoi(optarg);
+                break;
+            case 'L':
+                layout = strcmp(optarg, "eytzinger") == 0 ? BUCKET_LAYOUT_EYTZINGER : BUCKET_LAYOUT_SORTED;
+                break;
             case 'd':
                 debug = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
                 break;
@@ -52,122 +95,457 @@ int main(int argc, char* argv[]) {
             case 'k':
                 in_memory = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
                 break;
+            case 'R':
+                recompute = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'c':
+                calibrate_mode = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'P':
+                profile_file = optarg;
+                break;
+            case 'x':
+                trace_file = optarg;
+                break;
             case 'h':
                 printf("Help:\n"
-                       "  -f <filename>: Specify the output filename (default: buckets.bin)\n"
+                       "  -f <filename>: Specify the output filename, a comma separated list stripes the plot across files (default: buckets.bin)\n"
+                       "  -T <dirs>: Scratch directories for the temp file, a comma separated list stripes batches across them (default: .)\n"
+                       "  -a <start_nonce>: First nonce to hash, writes a shard for shardmerge (default: 0)\n"
+                       "  -n <num_nonces>: Number of nonces to hash, writes a shard for shardmerge (default: all)\n"
+                       "  -e <plot>: Extend a plot built with a smaller K, only the nonces it lacks are hashed and then merged with it\n"
+                       "  -b <bits_per_key>: Build a per bucket filter side file with this many bits per record, more bits lower the false positive rate (default: 0, off)\n"
+                       "  -p <prefix_bytes>: Hash prefix bytes stored in the filter (default: %d)\n"
+                       "  -L <layout>: Record order inside each bucket, sorted or eytzinger (default: sorted)\n"
                        "  -d <bool>: Enable debug mode\n"
                        "  -m <memory_mb>: Set memory size in MB (default: 1024MB)\n"
                        "  -s <file_size_mb>: Set file size in MB (default: 1024MB)\n"
-                       "  -t <num_threads_hash>: Set number of threads for hashing (default: 1)\n"
-                       "  -o <num_threads_sort>: Set number of threads for sorting (default: 1)\n"
-                       "  -i <num_threads_write>: Set number of threads for writing (default: 1)\n"
-                       "  -k <bool> enable sorting and storing all in memory\n"
-                       "  -h: Display this help message\n");
+                       "  -t <num_threads_hash>: Set number of threads for hashing (default: profile, else 1)\n"
+                       "  -o <num_threads_sort>: Set number of threads for sorting (default: profile, else 1)\n"
+                       "  -i <num_threads_write>: Set number of threads writing each batch to the temp file (default: profile, else 1)\n"
+                       "  -k <bool> build the whole plot in one exact size memory arena, no temp files\n"
+                       "  -R <bool>: No temp file, hash every nonce again for each range of buckets that fits in -m and append it to the plot\n"
+                       "  -c <bool>: Calibrate -t, -o and -i with short probes against the first scratch directory, save them to the profile and exit\n"
+                       "  -P <profile>: Profile loaded for thread counts not given as flags (default: " DEFAULT_PROFILE ")\n"
+                       "  -x <trace>: Write a Chrome trace of every thread's phases, needs a make TRACE=1 build\n"
+                       "  -h: Display this help message\n", default_filter_prefix_bytes());
                 return 0;
             default:
                 printf("Help:\n"
-                       "  -f <filename>: Specify the output filename (default: buckets.bin)\n"
+                       "  -f <filename>: Specify the output filename, a comma separated list stripes the plot across files (default: buckets.bin)\n"
+                       "  -T <dirs>: Scratch directories for the temp file, a comma separated list stripes batches across them (default: .)\n"
+                       "  -a <start_nonce>: First nonce to hash, writes a shard for shardmerge (default: 0)\n"
+                       "  -n <num_nonces>: Number of nonces to hash, writes a shard for shardmerge (default: all)\n"
+                       "  -e <plot>: Extend a plot built with a smaller K, only the nonces it lacks are hashed and then merged with it\n"
+                       "  -b <bits_per_key>: Build a per bucket filter side file with this many bits per record, more bits lower the false positive rate (default: 0, off)\n"
+                       "  -p <prefix_bytes>: Hash prefix bytes stored in the filter (default: %d)\n"
+                       "  -L <layout>: Record order inside each bucket, sorted or eytzinger (default: sorted)\n"
                        "  -d <bool>: Enable debug mode\n"
                        "  -m <memory_mb>: Set memory size in MB (default: 16MB)\n"
                        "  -s <file_size_mb>: Set file size in MB (default: 1024MB)\n"
-                       "  -t <num_threads_hash>: Set number of threads for hashing (default: 1)\n"
-                       "  -o <num_threads_sort>: Set number of threads for sorting (default: 1)\n"
-                       "  -i <num_threads_write>: Set number of threads for writing (default: 1)\n"
-                       "  -k <bool> enable sorting and storing all in memory\n"
-                       "  -h: Display this help message\n");
+                       "  -t <num_threads_hash>: Set number of threads for hashing (default: profile, else 1)\n"
+                       "  -o <num_threads_sort>: Set number of threads for sorting (default: profile, else 1)\n"
+                       "  -i <num_threads_write>: Set number of threads writing each batch to the temp file (default: profile, else 1)\n"
+                       "  -k <bool> build the whole plot in one exact size memory arena, no temp files\n"
+                       "  -R <bool>: No temp file, hash every nonce again for each range of buckets that fits in -m and append it to the plot\n"
+                       "  -c <bool>: Calibrate -t, -o and -i with short probes against the first scratch directory, save them to the profile and exit\n"
+                       "  -P <profile>: Profile loaded for thread counts not given as flags (default: " DEFAULT_PROFILE ")\n"
+                       "  -x <trace>: Write a Chrome trace of every thread's phases, needs a make TRACE=1 build\n"
+                       "  -h: Display this help message\n", default_filter_prefix_bytes());
                 return 0;
         }
     }
     
+    char* output_files[MAX_PATHS];
+    size_t num_outputs = split_paths(filename, output_files, MAX_PATHS);
+    if (num_outputs == 0 || num_outputs > NUM_BUCKETS) {
+        fprintf(stderr, "Need between 1 and %llu output files\n", NUM_BUCKETS);
+        return 1;
+    }
+
+    char* scratch_dirs[MAX_PATHS];
+    size_t num_temp_files = split_paths(scratch, scratch_dirs, MAX_PATHS);
+    if (num_temp_files == 0) {
+        fprintf(stderr, "Need at least one scratch directory\n");
+        return 1;
+    }
+
+    if (calibrate_mode) {
+        TuningProfile profile;
+        int max_threads = omp_get_num_procs();
+        printf("Calibrating up to %d threads with %s as scratch\n", max_threads, scratch_dirs[0]);
+        if (calibrate(scratch_dirs[0], max_threads, &profile) != 0 || profile_save(&profile, profile_file) != 0) {
+            return 1;
+        }
+        printf("Saved -t %d -o %d -i %d to %s\n", profile.num_threads_hash, profile.num_threads_sort, profile.num_threads_write, profile_file);
+        return 0;
+    }
+
+    TuningProfile profile = {1, 1, 1};
+    if (profile_load(&profile, profile_file) < 0) {
+        perror("Failed to read profile");
+        return 1;
+    }
+    if (num_threads_hash <= 0) num_threads_hash = profile.num_threads_hash; //Flags win over the profile
+    if (num_threads_sort <= 0) num_threads_sort = profile.num_threads_sort;
+    if (num_threads_write <= 0) num_threads_write = profile.num_threads_write;
+
     if (debug) {
         printf("NUM_THREADS_HASH=%d\n", num_threads_hash);
         printf("NUM_THREADS_SORT=%d\n", num_threads_sort);
         printf("NUM_THREADS_WRITE=%d\n", num_threads_write);
-        printf("FILENAME=%s\n", filename);
+        printf("FILENAME=%s\n", output_files[0]);
+        printf("STRIPES=%zu\n", num_outputs);
+        printf("SCRATCH_DIRS=%zu\n", num_temp_files);
         printf("MEMORY_SIZE=%dMB\n", memory_mb);
         printf("FILESIZE=%dMB\n", file_size_mb);
         printf("RECORD_SIZE=%zuB\n", sizeof(Record));
         printf("HASH_SIZE=%dB\n", HASH_SIZE);
         printf("NONCE_SIZE=%dB\n", NONCE_SIZE);
         printf("BUCKETS=%lld\n", NUM_BUCKETS);
+        printf("START_NONCE=%lu\n", (unsigned long)start_nonce);
+        printf("NUM_NONCES=%lu\n", (unsigned long)num_nonces);
+        printf("EXTEND=%s\n", extend_file ? extend_file : "none");
+    }
+
+    PlotOptions options = {
+        .output_files = output_files,
+        .num_outputs = num_outputs,
+        .scratch_dirs = scratch_dirs,
+        .num_scratch_dirs = num_temp_files,
+        .shard_mode = start_nonce != 0 || num_nonces != 0, //Any nonce range turns the output into a shard
+        .start_nonce = start_nonce,
+        .num_nonces = num_nonces,
+        .extend_file = extend_file,
+        .in_memory = in_memory,
+        .recompute = recompute,
+        .memory_mb = memory_mb,
+        .filter_bits_per_key = filter_bits_per_key,
+        .filter_prefix_bytes = filter_prefix_bytes,
+        .layout = layout,
+        .num_threads_hash = num_threads_hash,
+        .num_threads_sort = num_threads_sort,
+        .num_threads_write = num_threads_write,
+    };
+
+    double start_time = omp_get_wtime();
+    int generated = generate_plot(&options, progress_print, NULL);
+    if (trace_file && trace_write(trace_file) == 0) { //Written for failed runs too, they are the ones worth looking at
+        printf("Trace written to %s\n", trace_file);
+    }
+    if (generated != 0) {
+        return 1;
+    }
+
+    double total_time = omp_get_wtime() - start_time;
+    double mhps = (options.num_nonces / 1e6) / total_time;
+    double mbps = ((options.num_nonces * sizeof(Record)) / 1e6) / total_time;
+
+    if (options.recompute) {
+        printf("Recomputed the nonces in %zu passes\n", options.num_passes);
     }
+    printf("Completed %d MB file %s (%zu stripes) in %.2f seconds : %.2f MH/s %.2f MB/s\n", file_size_mb, output_files[0], num_outputs, total_time, mhps, mbps);
+    return 0;
+}
+#endif
+
+static int resolve_nonce_range(PlotOptions* options) {
+    if (options->extend_file) {
+        if (options->shard_mode || options->in_memory || options->recompute) {
+            fprintf(stderr, "Extending a plot picks its own nonce range and cannot run in memory or recompute\n");
+            return -1;
+        }
+        for (size_t s = 0; s < options->num_outputs; s++) {
+            if (strcmp(options->output_files[s], options->extend_file) == 0) {
+                fprintf(stderr, "The extended plot must go to a new file, %s is read while it is written\n", options->extend_file);
+                return -1;
+            }
+        }
+
+        FILE* old_plot = fopen(options->extend_file, "rb");
+        if (!old_plot) {
+            perror("Failed to open plot to extend");
+            return -1;
+        }
+        ShardHeader old_header;
+        int old_status = read_plot_as_shard(old_plot, options->extend_file, &old_header);
+        fclose(old_plot);
+        if (old_status != 0) {
+            return -1;
+        }
+        if (old_header.num_nonces >= NUM_RECORDS) {
+            fprintf(stderr, "%s already holds %llu nonces, build hashgen with a larger K to extend it\n", options->extend_file, NUM_RECORDS);
+            return -1;
+        }
+        options->start_nonce = old_header.num_nonces; //The old plot covers nonces 0 to 2^k - 1, hash the rest
+        options->num_nonces = NUM_RECORDS - options->start_nonce;
+    }
+    if (options->num_nonces == 0) options->num_nonces = NUM_RECORDS - (options->start_nonce < NUM_RECORDS ? options->start_nonce : NUM_RECORDS);
+    if (options->start_nonce >= NUM_RECORDS || options->num_nonces > NUM_RECORDS - options->start_nonce) {
+        fprintf(stderr, "Nonce range must be inside the %llu nonces of the plot\n", NUM_RECORDS);
+        return -1;
+    }
+    if (options->shard_mode && (options->num_outputs > 1 || options->in_memory || options->recompute || options->filter_bits_per_key > 0)) {
+        fprintf(stderr, "Shards are written to a single file and cannot use in memory or recompute mode or a filter, build the filter with shardmerge\n");
+        return -1;
+    }
+    if (options->layout == BUCKET_LAYOUT_EYTZINGER && options->shard_mode) {
+        fprintf(stderr, "Shards stay sorted for shardmerge, pick the layout when merging them\n");
+        return -1;
+    }
+    if (options->layout == BUCKET_LAYOUT_EYTZINGER && !EYTZINGER_SUPPORTED) {
+        fprintf(stderr, "Buckets of %llu records leave no count bit for the layout flag, build with COUNT_BITS=32\n", (unsigned long long)RECORDS_BIG_BUCKET);
+        return -1;
+    }
+    return 0;
+}
+
+static void finish_plot(char** output_files, size_t num_outputs, BucketFilter* filter, BucketChecksums* checksums) { //Save the side files and sync the stripes
+    if (filter->blocks) { //The filter lives next to the first stripe
+        if (filter_save(filter, output_files[0]) != 0) {
+            fprintf(stderr, "Failed to write the filter\n");
+        }
+        filter_free(filter);
+    }
+    if (checksums) { //So are the bucket checksums
+        if (checksums_save(checksums, output_files[0]) != 0) {
+            fprintf(stderr, "Failed to write the checksums\n");
+        }
+        checksums_free(checksums);
+    }
+
+    #pragma omp parallel for num_threads((int)num_outputs) schedule(static, 1) //Every stripe's device flushes at the same time
+    for (size_t s = 0; s < num_outputs; s++) {
+        FILE* out_final = fopen(output_files[s], "rb+");
+        if (out_final) {
+            fflush(out_final);
+            TRACE_BEGIN(fsync);
+            fsync(fileno(out_final));
+            TRACE_END(fsync, "fsync");
+            fclose(out_final);
+        }
+    }
+}
+
+static int generate_plot_in_ram(PlotOptions* options, ProgressCallback callback, void* user) {
+    int num_threads = options->num_threads_hash > options->num_threads_sort ? options->num_threads_hash : options->num_threads_sort;
+    size_t max_pass_records = SIZE_MAX; //-k holds every record at once
+    size_t chunk_buckets = image_buckets(INMEM_WRITE_SIZE);
+    if (options->in_memory) {
+        size_t needed_mb = in_memory_plot_mb(options->num_nonces, num_threads);
+        if (needed_mb > (size_t)options->memory_mb) {
+            fprintf(stderr, "Plotting in memory needs %zu MB, raise -m or drop -k\n", needed_mb);
+            return -1;
+        }
+    } else {
+        max_pass_records = recompute_pass_records(options->memory_mb, options->num_threads_hash, options->num_threads_sort, &chunk_buckets);
+        if (max_pass_records < RECORDS_BIG_BUCKET) {
+            fprintf(stderr, "Recompute passes need at least %zu MB with %d hash and %d sort threads, raise -m\n",
+                    recompute_min_mb(options->num_threads_hash, options->num_threads_sort), options->num_threads_hash, options->num_threads_sort);
+            return -1;
+        }
+    }
+
+    BucketFilter filter = {0};
+    if (options->filter_bits_per_key > 0 && filter_init(&filter, options->filter_bits_per_key, options->filter_prefix_bytes, RECORDS_BIG_BUCKET) != 0) {
+        return -1;
+    }
+    BucketChecksums checksums = {0};
+    if (checksums_init(&checksums) != 0) {
+        filter_free(&filter);
+        return -1;
+    }
+    checksums.header.nonce_end = options->start_nonce + options->num_nonces; //So the plot can be extended whatever its K
+
+    Progress progress;
+    progress_init(&progress, callback, user);
+    if (generate_plot_in_passes(options->start_nonce, options->num_nonces, options->output_files, options->num_outputs, filter.blocks ? &filter : NULL, &checksums, options->layout,
+                                max_pass_records, chunk_buckets, options->num_threads_hash, options->num_threads_sort, &progress, &options->num_passes) != 0) {
+        filter_free(&filter);
+        checksums_free(&checksums);
+        return -1;
+    }
+
+    finish_plot(options->output_files, options->num_outputs, &filter, &checksums);
+    return 0;
+}
+
+static int generate_plot_through_temp(PlotOptions* options, char* extend_shard, ProgressCallback callback, void* user) { //extend_shard is where -e sorts the new nonces
+    char** output_files = options->output_files;
+    size_t num_outputs = options->num_outputs;
+    char** scratch_dirs = options->scratch_dirs;
+    size_t num_temp_files = options->num_scratch_dirs;
+    const char* extend_file = options->extend_file;
+    bool shard_mode = options->shard_mode;
+    uint64_t start_nonce = options->start_nonce;
+    uint64_t num_nonces = options->num_nonces;
+    int num_threads_sort = options->num_threads_sort;
+    int num_threads_write = options->num_threads_write;
 
     int num_prefix_bytes = calc_prefix_bytes(NUM_BUCKETS);
 
     int mb_per_batch = (sizeof(Bucket) * NUM_BUCKETS) / (1024 * 1024);
 
-    double start_time = omp_get_wtime();
-    double last_print_time = omp_get_wtime();
-    if ((mb_per_batch > memory_mb) || (in_memory && NUM_BATCHES > 1)){ //Check if your dumps use too much memory
-        printf("Too much memory per bucket dump or too little bucket space for in memory: %d\n",mb_per_batch);
-        return 1;
+    if (mb_per_batch > options->memory_mb){ //Check if your dumps use too much memory
+        fprintf(stderr, "Too much memory per bucket dump: %d\n",mb_per_batch);
+        return -1;
     }
     
     uint8_t nonce[NONCE_SIZE] = {0};
+    nonce_from_u64(start_nonce, nonce);
     size_t records_generated = 0;
     size_t records_per_batch = NUM_BUCKETS * MAX_RECORDS_PER_BUCKET;
+    size_t num_batches = (num_nonces + records_per_batch - 1) / records_per_batch;
 
-    FILE* out = fopen(TEMP_FILE, "wb");
-    if (!out) {
-        perror("Failed to open output file");
-        return 1;
+    char* temp_files[MAX_PATHS];
+    if (make_temp_paths(scratch_dirs, num_temp_files, temp_files) != 0) {
+        return -1;
+    }
+
+    for (size_t f = 0; f < num_temp_files; f++) {
+        FILE* out = fopen(temp_files[f], "wb");
+        if (!out) {
+            perror("Failed to open output file");
+            free_temp_paths(temp_files, num_temp_files);
+            return -1;
+        }
+        if (preallocate_file(out, temp_batches_in_file(f, num_temp_files, num_batches) * TEMP_BATCH_SIZE) != 0) {
+            perror("Failed to preallocate temp file");
+            fclose(out);
+            free_temp_paths(temp_files, num_temp_files);
+            return -1;
+        }
+        fclose(out);
+    }
+
+    BucketFilter filter = {0};
+    if (options->filter_bits_per_key > 0 && filter_init(&filter, options->filter_bits_per_key, options->filter_prefix_bytes, RECORDS_BIG_BUCKET) != 0) {
+        free_temp_paths(temp_files, num_temp_files);
+        return -1;
     }
-    fclose(out);
 
     Bucket* buckets = calloc(NUM_BUCKETS, sizeof(Bucket));
 
     if (!buckets) {
         fprintf(stderr, "Failed to allocate memory for buckets\n");
-        return 1;
+        filter_free(&filter);
+        free_temp_paths(temp_files, num_temp_files);
+        return -1;
     }
 
-    omp_set_num_threads(num_threads_hash);
+    size_t batch = 0;
+    long temp_offsets[MAX_PATHS] = {0}; //Compact batches vary in size, so each temp file is filled front to back
+    Progress progress;
+    progress_init(&progress, callback, user);
+
+    omp_set_num_threads(options->num_threads_hash);
     
-    while (records_generated < NUM_RECORDS) { // Keep generating records until we hit the amount we were going for 
+    while (records_generated < num_nonces) { // Keep generating records until we hit the amount we were going for 
         size_t this_batch = records_per_batch;
 
-        if (NUM_RECORDS - records_generated < this_batch){
-            this_batch = NUM_RECORDS - records_generated;
+        if (num_nonces - records_generated < this_batch){
+            this_batch = num_nonces - records_generated;
         }
 
         
-        generate_records(nonce, num_prefix_bytes, buckets, this_batch, &last_print_time, records_generated, debug);
+        generate_records(nonce, num_prefix_bytes, buckets, this_batch, records_generated, &progress);
 
         for (size_t i = 0; i < this_batch; ++i) { //Keep the nonce updated
             increment_nonce(nonce, NONCE_SIZE);
         }
 
-        if (!in_memory){
-            if (dump_buckets(buckets, NUM_BUCKETS, TEMP_FILE) != 0) {
-                fprintf(stderr, "Failed to dump records\n");
-                free(buckets);
-                return 1;
-            }
+        size_t batch_size = 0;
+        if (dump_buckets(buckets, NUM_BUCKETS, start_nonce + records_generated, temp_files[batch % num_temp_files], temp_offsets[batch % num_temp_files], num_threads_write, &batch_size) != 0) { //Deal batches round robin across the scratch directories
+            fprintf(stderr, "Failed to dump records\n");
+            free(buckets);
+            filter_free(&filter);
+            free_temp_paths(temp_files, num_temp_files);
+            return -1;
         }
+        temp_offsets[batch % num_temp_files] += batch_size;
         records_generated += this_batch;
+        batch++;
     }
 
-        if (in_memory) {
-            sort_buckets_in_memory(buckets, filename);
-            free(buckets);
-        }
-        else{
-            free(buckets);
-            merge_and_sort_buckets(TEMP_FILE,filename,num_threads_sort);
+    BucketChecksums checksums = {0}; //Shards get theirs when they are merged into a plot
+    if (!shard_mode && checksums_init(&checksums) != 0) {
+        free(buckets);
+        filter_free(&filter);
+        free_temp_paths(temp_files, num_temp_files);
+        return -1;
+    }
+    checksums.header.nonce_end = start_nonce + num_nonces; //So the plot can be extended whatever its K
+    BucketChecksums* plot_checksums = checksums.sums ? &checksums : NULL;
+
+    progress_init(&progress, callback, user); //Sorting is a new stage with its own clock
+    free(buckets);
+    ShardHeader shard;
+    init_shard_header(&shard, start_nonce, num_nonces, num_batches);
+
+    char* sort_outputs[1] = {extend_shard};
+
+    int sorted;
+    if (extend_file) { //The new nonces are sorted into a shard in scratch, then streamed together with the old plot
+        sorted = merge_and_sort_buckets(temp_files, num_temp_files, sort_outputs, 1, num_batches, &shard, NULL, NULL, BUCKET_LAYOUT_SORTED, num_threads_sort, &progress);
+    } else {
+        sorted = merge_and_sort_buckets(temp_files, num_temp_files, output_files, num_outputs, num_batches, shard_mode ? &shard : NULL, filter.blocks ? &filter : NULL, plot_checksums, options->layout, num_threads_sort, &progress);
+    }
+
+    for (size_t f = 0; f < num_temp_files; f++) { //The temp data is useless once the plot is written
+        if (remove(temp_files[f]) != 0) {
+            perror("Failed to remove temp file");
         }
-    
-        FILE* out_final = fopen(filename, "rb+");
-        if (out_final) {
-            fflush(out_final);
-            fsync(fileno(out_final));
-            fclose(out_final);
+    }
+
+    if (sorted != 0) { //A partial plot gets no side files and is not reported as completed
+        fprintf(stderr, "Failed to sort the temp files into %s\n", extend_file ? extend_shard : output_files[0]);
+        filter_free(&filter);
+        checksums_free(&checksums);
+        free_temp_paths(temp_files, num_temp_files);
+        return -1;
+    }
+
+    if (extend_file) {
+        char* merge_inputs[2] = {(char*)extend_file, extend_shard};
+        int merged = merge_shards(merge_inputs, 2, output_files, num_outputs, filter.blocks ? &filter : NULL, plot_checksums, options->layout);
+        if (merged != 0) {
+            fprintf(stderr, "Failed to merge the new nonces into %s\n", extend_file);
+            filter_free(&filter);
+            checksums_free(&checksums);
+            free_temp_paths(temp_files, num_temp_files);
+            return -1;
         }
+    }
+    free_temp_paths(temp_files, num_temp_files);
+    finish_plot(output_files, num_outputs, &filter, plot_checksums);
+    return 0;
+}
 
-        double total_time = omp_get_wtime() - start_time;
-        double mhps = (NUM_RECORDS / 1e6) / total_time;
-        double mbps = ((NUM_RECORDS * sizeof(Record)) / 1e6) / total_time;
+int generate_plot(PlotOptions* options, ProgressCallback callback, void* user) {
+    if (resolve_nonce_range(options) != 0) {
+        return -1;
+    }
+    if (options->in_memory || options->recompute) { //No batches and no temp file, the plot is built in one arena or one per pass
+        return generate_plot_in_ram(options, callback, user);
+    }
+    if (!options->extend_file) {
+        return generate_plot_through_temp(options, NULL, callback, user);
+    }
 
-        printf("Completed %d MB file %s in %.2f seconds : %.2f MH/s %.2f MB/s\n", file_size_mb, filename, total_time, mhps, mbps);
-        return 0;
+    char extend_shard[4096]; //Named after the new plot, and claimed up front so two extends sharing a scratch directory cannot write the same shard
+    const char* plot_name = strrchr(options->output_files[0], '/') ? strrchr(options->output_files[0], '/') + 1 : options->output_files[0];
+    snprintf(extend_shard, sizeof(extend_shard), "%s/%s.extend.shard", options->scratch_dirs[0], plot_name);
+    int fd = open(extend_shard, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (errno == EEXIST) fprintf(stderr, "%s already exists, another extend may be using it, remove it if not\n", extend_shard);
+        else perror("Failed to create extend shard");
+        return -1;
     }
+    close(fd);
 
+    int status = generate_plot_through_temp(options, extend_shard, callback, user);
+    if (remove(extend_shard) != 0) {
+        perror("Failed to remove extend shard");
+    }
+    return status;
+}
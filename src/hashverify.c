@@ -6,6 +6,7 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
 
 #include <omp.h>
 
@@ -13,23 +14,29 @@
 
 #include "../BLAKE3/c/blake3.h"
 #include "../include/pos.h"
+#include "../include/keys.h"
+#include "../include/layout.h"
 #include "../include/hashverify.h"
+#include "../include/checksum.h"
+#include "../include/bulkverify.h"
 
-bool debug;
-size_t num_unsorted; //Some global variables for making the rest of the logic easier
-
+#ifndef POS_LIBRARY
 int main(int argc, char* argv[]) {
 
     char* filename = "buckets.bin";
     int num_records_head = 0;
     int num_records_tail = 0;
-    debug = false;
+    bool debug = false;
     bool verify_hashes = false;
     int num_valid_checks = 0;
+    bool quick = false;
+    int num_threads = 1;
+    char* proof_file = NULL;
+    bool digest = false;
     int opt;
 
 
-    while (( opt = getopt(argc, argv, "f:p:r:v:d:b:h")) != -1) {
+    while (( opt = getopt(argc, argv, "f:p:r:v:d:b:q:t:P:g:h")) != -1) {
         switch (opt) {
             case 'f':
                 filename = optarg;
@@ -49,12 +56,28 @@ int main(int argc, char* argv[]) {
             case 'b':
                 num_valid_checks = atoi(optarg);
                 break;
+            case 'q':
+                quick = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'P':
+                proof_file = optarg;
+                break;
+            case 'g':
+                digest = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
             case 'h':
                 printf("Help:\n"
                        "  -f <filename>: Specify the output filename\n"
                        "  -p <num_records>: Number of records to print from head\n"
                        "  -r <num_records>: Number of records to print from tail\n"
                        "  -v <bool>: Verify hashes from file, off with false, on with true\n"
+                       "  -q <bool>: Quick check of every bucket against the <file>.sums checksums written by hashgen, -f may list the stripes of a plot in order\n"
+                       "  -P <proof_file>: Bulk verify a stream of submitted proofs (16 byte hash and nonce records)\n"
+                       "  -t <num_threads>: Threads for the quick check and proof verification (default: 1)\n"
+                       "  -g <bool>: Print a BLAKE3 digest of the whole file, or of a comma separated list of stripes read in order, for comparing plots built with different settings\n"
                        "  -d <bool>: Enable debug mode\n"
                        "  -h: Display this help message\n");
                 return 0;
@@ -64,6 +87,10 @@ int main(int argc, char* argv[]) {
                        "  -p <num_records>: Number of records to print from head\n"
                        "  -r <num_records>: Number of records to print from tail\n"
                        "  -v <bool>: Verify hashes from file, off with false, on with true\n"
+                       "  -q <bool>: Quick check of every bucket against the <file>.sums checksums written by hashgen, -f may list the stripes of a plot in order\n"
+                       "  -P <proof_file>: Bulk verify a stream of submitted proofs (16 byte hash and nonce records)\n"
+                       "  -t <num_threads>: Threads for the quick check and proof verification (default: 1)\n"
+                       "  -g <bool>: Print a BLAKE3 digest of the whole file, or of a comma separated list of stripes read in order, for comparing plots built with different settings\n"
                        "  -d <bool>: Enable debug mode\n"
                        "  -h: Display this help message\n");
                 return 0;
@@ -87,8 +114,45 @@ int main(int argc, char* argv[]) {
     if (num_records_tail > 0 ){
         print_tail_records(filename, num_records_tail);
     }
-    ssize_t verified_records;
-    if (verify_hashes) verified_records = verify_hashes_file(filename, verify_hashes);
+    if (digest) {
+        uint8_t file_digest[BLAKE3_OUT_LEN];
+        if (digest_file(filename, file_digest) != 0) return 1;
+        printf("File digest: ");
+        for (int i = 0; i < BLAKE3_OUT_LEN; i++) printf("%02x", file_digest[i]);
+        printf("\n");
+    }
+    if (quick) {
+        double quick_start = omp_get_wtime();
+        ssize_t bad_buckets = verify_checksums_file(filename, num_threads);
+        if (bad_buckets < 0) {
+            fprintf(stderr, "Quick check could not run\n");
+            return 1;
+        }
+        double quick_time = omp_get_wtime() - quick_start;
+        printf("Buckets checked: %llu\n", NUM_BUCKETS);
+        printf("Buckets failing their checksum: %zd\n", bad_buckets);
+        printf("Quick check took %.2f seconds : %.1f MB/s\n", quick_time, NUM_BUCKETS * BIG_BUCKET_SIZE / 1e6 / quick_time);
+        if (bad_buckets > 0) return 1;
+    }
+
+    if (proof_file) {
+        double proof_start = omp_get_wtime();
+        size_t num_proofs = 0;
+        ssize_t bad_proofs = verify_proof_file(proof_file, num_threads, &num_proofs);
+        if (bad_proofs < 0) {
+            fprintf(stderr, "Proof verification could not run\n");
+            return 1;
+        }
+        double proof_time = omp_get_wtime() - proof_start;
+        printf("Proofs checked: %zu\n", num_proofs);
+        printf("Proofs failing: %zd\n", bad_proofs);
+        printf("Proof verification took %.2f seconds : %.2f MH/s\n", proof_time, num_proofs / 1e6 / proof_time);
+        if (bad_proofs > 0) return 1;
+    }
+
+    ssize_t verified_records = 0;
+    size_t num_unsorted = 0;
+    if (verify_hashes) verified_records = verify_hashes_file(filename, &num_unsorted, debug);
     if(verify_hashes && verified_records <= 0){
         fprintf(stderr,"Something failed in verifying files");
         return 1;
@@ -117,8 +181,22 @@ int main(int argc, char* argv[]) {
 
     return 0;
 }
+#endif
+
+static int put_in_key_order(Record* records, size_t count, const uint8_t* header) { //Eytzinger buckets are walked in order so they read back like sorted ones
+    if (decode_bucket_layout(header) != BUCKET_LAYOUT_EYTZINGER || count == 0) return 0;
+    Record* sorted = malloc(count * sizeof(Record));
+    if (!sorted) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    eytzinger_to_sorted(records, sorted, count);
+    memcpy(records, sorted, count * sizeof(Record));
+    free(sorted);
+    return 0;
+}
 
-ssize_t verify_hashes_file(const char* filename, bool verify_hashes) {
+ssize_t verify_hashes_file(const char* filename, size_t* num_unsorted, bool debug) {
     FILE* file = fopen(filename, "rb");
     if (!file) {
         perror("Failed to open the file");
@@ -126,26 +204,25 @@ ssize_t verify_hashes_file(const char* filename, bool verify_hashes) {
     }
 
     size_t total_records = 0;
-    num_unsorted = 0;
+    size_t unsorted = 0;
     const size_t record_size = sizeof(Record);
 
     double start_time = omp_get_wtime();
     double last_print_time = start_time;
-    static int print_count = 0;
 
-    Record prev_record;
+    Record prev_record = {0};
     bool has_prev = false;
 
     for (size_t bucket = 0; bucket < NUM_BUCKETS; bucket++) {
-        uint8_t header[2];
-        if (fread(header, 1, 2, file) != 2) {
+        uint8_t header[BUCKET_HEADER_SIZE];
+        if (fread(header, 1, BUCKET_HEADER_SIZE, file) != BUCKET_HEADER_SIZE) {
             fprintf(stderr, "Failed to read record count header for bucket %zu\n", bucket);
             break;
         }
 
-        uint16_t record_count = header[0] | (header[1] << 8);
+        size_t record_count = decode_bucket_count(header);
         if (record_count > RECORDS_BIG_BUCKET) {
-            fprintf(stderr, "Invalid record count %u in bucket %zu\n", record_count, bucket);
+            fprintf(stderr, "Invalid record count %zu in bucket %zu\n", record_count, bucket);
             break;
         }
 
@@ -160,16 +237,16 @@ ssize_t verify_hashes_file(const char* filename, bool verify_hashes) {
             free(records);
             break;
         }
-
-        for (size_t i = 1; i < record_count; i++) {
-            if (memcmp(records[i - 1].hash, records[i].hash, HASH_SIZE) > 0) {
-                num_unsorted++;
-            }
+        if (put_in_key_order(records, record_count, header) != 0) {
+            free(records);
+            break;
         }
 
+        unsorted += key_count_unsorted(records, record_count);
+
         if (has_prev && record_count > 0) {
-            if (memcmp(prev_record.hash, records[0].hash, HASH_SIZE) > 0) {
-                num_unsorted++;
+            if (key_compare(prev_record.hash, records[0].hash) > 0) {
+                unsorted++;
             }
         }
         if (record_count > 0) {
@@ -187,7 +264,6 @@ ssize_t verify_hashes_file(const char* filename, bool verify_hashes) {
             double percent = 100.0 * total_records / NUM_RECORDS;
             double eta = elapsed * (NUM_RECORDS - total_records) / (total_records + 1e-5);
 
-            print_count++;
             printf("[%.3f][VERIFY]: %.2f%% completed, ETA %.1f seconds\n", elapsed, percent, eta);
             fflush(stdout);
             last_print_time = now;
@@ -195,12 +271,19 @@ ssize_t verify_hashes_file(const char* filename, bool verify_hashes) {
     }
 
     fclose(file);
+    if (num_unsorted) *num_unsorted = unsorted;
     return total_records;
 }
 
 
 
 
+static int compare_indices(const void* a, const void* b) {
+    size_t index_a = *(const size_t*)a;
+    size_t index_b = *(const size_t*)b;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
 int verify_random_hashes(const char* filename, size_t count) { 
     if (count == 0) return -1;
 
@@ -212,7 +295,7 @@ int verify_random_hashes(const char* filename, size_t count) {
 
     const size_t record_size = sizeof(Record);
     size_t* bucket_offsets = malloc(NUM_BUCKETS * sizeof(size_t));
-    uint16_t* bucket_counts = calloc(NUM_BUCKETS, sizeof(uint16_t));
+    bucket_count_t* bucket_counts = calloc(NUM_BUCKETS, sizeof(bucket_count_t));
     size_t offset = 0, total_records = 0;
 
     for (size_t i = 0; i < NUM_BUCKETS; i++) {
@@ -224,22 +307,22 @@ int verify_random_hashes(const char* filename, size_t count) {
             return -1;
         }
 
-        uint8_t header[2];
-        if (fread(header, 1, 2, file) != 2) {
+        uint8_t header[BUCKET_HEADER_SIZE];
+        if (fread(header, 1, BUCKET_HEADER_SIZE, file) != BUCKET_HEADER_SIZE) {
             perror("header read");
             free(bucket_offsets); free(bucket_counts); fclose(file);
             return -1;
         }
 
-        uint16_t count_in_bucket = header[0] | (header[1] << 8);
+        size_t count_in_bucket = decode_bucket_count(header);
         if (count_in_bucket > RECORDS_BIG_BUCKET) {
-            fprintf(stderr, "Invalid count %u in bucket %zu\n", count_in_bucket, i);
+            fprintf(stderr, "Invalid count %zu in bucket %zu\n", count_in_bucket, i);
             free(bucket_offsets); free(bucket_counts); fclose(file);
             return -1;
         }
 
         bucket_counts[i] = count_in_bucket;
-        offset += 2 + RECORDS_BIG_BUCKET * record_size;
+        offset += BUCKET_HEADER_SIZE + RECORDS_BIG_BUCKET * record_size;
         total_records += count_in_bucket;
     }
 
@@ -251,21 +334,21 @@ int verify_random_hashes(const char* filename, size_t count) {
 
     if (count > total_records) count = total_records;
 
-    srand(time(NULL));
+    unsigned int seed = time(NULL); //rand_r keeps the generator state local to this call
     size_t* indices = malloc(count * sizeof(size_t)); //generate random numbers inside of the actual amount of records range
     for (size_t i = 0; i < count; i++) {
-        indices[i] = rand() % total_records;
+        indices[i] = rand_r(&seed) % total_records;
     }
-    qsort(indices, count, sizeof(size_t), (__compar_fn_t)memcmp);
+    qsort(indices, count, sizeof(size_t), compare_indices);
 
     size_t current_global = 0, current_index = 0;
     size_t verified = 0, failed = 0;
 
     for (size_t b = 0; b < NUM_BUCKETS && current_index < count; b++) {
-        uint16_t bucket_count = bucket_counts[b];
+        size_t bucket_count = bucket_counts[b];
         if (bucket_count == 0) continue;
 
-        if (fseek(file, bucket_offsets[b] + 2, SEEK_SET) != 0) {
+        if (fseek(file, bucket_offsets[b] + BUCKET_HEADER_SIZE, SEEK_SET) != 0) {
             perror("Failed to seek to bucket data");
             break;
         }
@@ -304,13 +387,139 @@ int verify_random_hashes(const char* filename, size_t count) {
     return failed;
 }
 
+int digest_file(const char* filename, uint8_t* digest) {
+    char* list = strdup(filename); //Stripes are hashed one after another, so a striped plot digests like the same plot in one file
+    char* paths[MAX_PATHS];
+    size_t num_paths = list ? split_paths(list, paths, MAX_PATHS) : 0;
+    uint8_t* buffer = malloc(CHECKSUM_READ_SIZE);
+    if (!list || !buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(list);
+        free(buffer);
+        return -1;
+    }
+
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    int status = 0;
+    for (size_t p = 0; p < num_paths && status == 0; p++) {
+        FILE* file = fopen(paths[p], "rb");
+        if (!file) {
+            perror("Failed to open the file");
+            status = -1;
+            break;
+        }
+
+        size_t got;
+        while ((got = fread(buffer, 1, CHECKSUM_READ_SIZE, file)) > 0) {
+            blake3_hasher_update(&hasher, buffer, got);
+        }
+        if (ferror(file)) {
+            perror("Failed to read the file");
+            status = -1;
+        }
+        fclose(file);
+    }
+    blake3_hasher_finalize(&hasher, digest, BLAKE3_OUT_LEN);
+
+    free(buffer);
+    free(list);
+    return status;
+}
+
+ssize_t verify_checksums_file(const char* filename, int num_threads) {
+    char* list = strdup(filename); //A striped plot is its stripes in bucket order, the side file sits next to the first
+    char* paths[MAX_PATHS];
+    size_t num_stripes = list ? split_paths(list, paths, MAX_PATHS) : 0;
+    if (num_stripes == 0 || num_stripes > NUM_BUCKETS) {
+        fprintf(stderr, "Need between 1 and %llu stripes\n", NUM_BUCKETS);
+        free(list);
+        return -1;
+    }
+
+    BucketChecksums checksums;
+    int loaded = checksums_load(&checksums, paths[0]);
+    if (loaded != 0) {
+        if (loaded > 0) fprintf(stderr, "No checksum side file for %s\n", paths[0]);
+        free(list);
+        return -1;
+    }
+
+    int fds[MAX_PATHS];
+    for (size_t s = 0; s < num_stripes; s++) {
+        fds[s] = open(paths[s], O_RDONLY);
+        off_t expected = (off_t)((stripe_first_bucket(s + 1, num_stripes) - stripe_first_bucket(s, num_stripes)) * BIG_BUCKET_SIZE);
+        off_t file_size = fds[s] < 0 ? -1 : lseek(fds[s], 0, SEEK_END);
+        if (fds[s] < 0 || file_size != expected) {
+            if (fds[s] < 0) perror("Failed to open the file");
+            else fprintf(stderr, "%s is not stripe %zu of %zu of a plot with %llu buckets\n", paths[s], s + 1, num_stripes, NUM_BUCKETS);
+            if (fds[s] >= 0) close(fds[s]);
+            while (s > 0) close(fds[--s]);
+            checksums_free(&checksums);
+            free(list);
+            return -1;
+        }
+        posix_fadvise(fds[s], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    size_t buckets_per_chunk = CHECKSUM_READ_SIZE / BIG_BUCKET_SIZE; //Big reads keep the device streaming, the hashing happens in parallel
+    if (buckets_per_chunk == 0) buckets_per_chunk = 1;
+    size_t num_chunks = (NUM_BUCKETS + buckets_per_chunk - 1) / buckets_per_chunk;
+    ssize_t bad_buckets = 0;
+    int failed = 0;
+
+    #pragma omp parallel num_threads(num_threads) reduction(+:bad_buckets) reduction(|:failed)
+    {
+        uint8_t* chunk = malloc(buckets_per_chunk * BIG_BUCKET_SIZE);
+        if (!chunk) failed = 1;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (size_t c = 0; c < num_chunks; c++) {
+            if (!chunk) continue;
+            size_t first = c * buckets_per_chunk;
+            size_t count = NUM_BUCKETS - first < buckets_per_chunk ? NUM_BUCKETS - first : buckets_per_chunk;
+
+            bool read_all = true;
+            for (size_t b = first; b < first + count && read_all;) { //One read per stripe the chunk touches
+                size_t stripe = stripe_of_bucket(b, num_stripes);
+                size_t run_end = stripe_first_bucket(stripe + 1, num_stripes) < first + count ? stripe_first_bucket(stripe + 1, num_stripes) : first + count;
+                size_t run_size = (run_end - b) * BIG_BUCKET_SIZE;
+                if (pread(fds[stripe], chunk + (b - first) * BIG_BUCKET_SIZE, run_size, (off_t)(b - stripe_first_bucket(stripe, num_stripes)) * BIG_BUCKET_SIZE) != (ssize_t)run_size) {
+                    perror("Failed to read buckets");
+                    read_all = false;
+                }
+                b = run_end;
+            }
+            if (!read_all) {
+                failed = 1;
+                continue;
+            }
+            for (size_t b = 0; b < count; b++) {
+                if (!checksums_match(&checksums, first + b, chunk + b * BIG_BUCKET_SIZE)) {
+                    fprintf(stderr, "Bucket %zu fails its checksum\n", first + b);
+                    bad_buckets++;
+                }
+            }
+        }
+
+        free(chunk);
+    }
+
+    for (size_t s = 0; s < num_stripes; s++) {
+        close(fds[s]);
+    }
+    checksums_free(&checksums);
+    free(list);
+    return failed ? -1 : bad_buckets;
+}
+
 int verify_hash(const Record* record) {
     uint8_t test_hash[HASH_SIZE];
     blake3_hasher hasher;
     blake3_hasher_init(&hasher);
     blake3_hasher_update(&hasher, record->nonce, NONCE_SIZE);
     blake3_hasher_finalize(&hasher, test_hash, HASH_SIZE);
-    return memcmp(test_hash, record->hash, HASH_SIZE) == 0;
+    return key_equal(test_hash, record->hash);
 }
 
 void print_record(const Record* record, size_t record_ct) {
@@ -352,13 +561,13 @@ void print_head_records(const char* filename, size_t record_ct) {
     size_t printed = 0;
 
     for (size_t i = 0; i < NUM_BUCKETS && printed < record_ct; i++) {
-        uint8_t header[2];
-        if (fread(header, 1, 2, file) != 2) {
+        uint8_t header[BUCKET_HEADER_SIZE];
+        if (fread(header, 1, BUCKET_HEADER_SIZE, file) != BUCKET_HEADER_SIZE) {
             perror("Failed to read record count header");
             break;
         }
 
-        uint16_t record_count = header[0] | (header[1] << 8);
+        size_t record_count = decode_bucket_count(header);
         if (record_count > RECORDS_BIG_BUCKET) {
             fprintf(stderr, "Invalid record count in bucket %zu\n", i);
             break;
@@ -375,6 +584,10 @@ void print_head_records(const char* filename, size_t record_ct) {
             free(records);
             break;
         }
+        if (put_in_key_order(records, record_count, header) != 0) {
+            free(records);
+            break;
+        }
 
         for (size_t j = 0; j < record_count && printed < record_ct; j++) {
             print_record(&records[j], printed);
@@ -405,20 +618,20 @@ void print_tail_records(const char* filename, size_t record_ct) {
     size_t printed = 0;
 
     for (ssize_t bucket = NUM_BUCKETS - 1; bucket >= 0 && printed < record_ct; bucket--) {
-        size_t bucket_offset = bucket * (2 + RECORDS_BIG_BUCKET * record_size);
+        size_t bucket_offset = bucket * (BUCKET_HEADER_SIZE + RECORDS_BIG_BUCKET * record_size);
 
         if (fseek(file, bucket_offset, SEEK_SET) != 0) {
             perror("Failed to seek to bucket header");
             break;
         }
 
-        uint8_t header[2];
-        if (fread(header, 1, 2, file) != 2) {
+        uint8_t header[BUCKET_HEADER_SIZE];
+        if (fread(header, 1, BUCKET_HEADER_SIZE, file) != BUCKET_HEADER_SIZE) {
             perror("Failed to read bucket header");
             break;
         }
 
-        uint16_t record_count = header[0] | (header[1] << 8);
+        size_t record_count = decode_bucket_count(header);
         if (record_count > RECORDS_BIG_BUCKET) {
             fprintf(stderr, "Invalid record count in bucket %zu\n", (size_t)bucket);
             break;
@@ -435,6 +648,10 @@ void print_tail_records(const char* filename, size_t record_ct) {
             free(records);
             break;
         }
+        if (put_in_key_order(records, record_count, header) != 0) {
+            free(records);
+            break;
+        }
 
         for (ssize_t j = record_count - 1; j >= 0 && printed < record_ct; j--) {
             print_record(&records[j], printed);
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "../include/libpos.h"
+#include "../include/lookup.h"
+#include "../include/hashverify.h"
+#include "../include/bulkverify.h"
+
+struct PosPlot {
+    PlotSet set;
+    char* paths; //split_paths cuts the list in place, so the plot keeps its own copy
+};
+
+struct PosScratch {
+    uint8_t* buffer;
+    int8_t status[LOOKUP_CHUNK_SIZE]; //Per query answers of one search_plot_set_many call in pos_lookup_batch
+};
+
+PosPlot* pos_plot_open(const char* paths, bool use_filters, bool verify_reads) {
+    PosPlot* plot = calloc(1, sizeof(PosPlot));
+    if (!plot) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    plot->paths = strdup(paths);
+    if (!plot->paths) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(plot);
+        return NULL;
+    }
+
+    char* split[MAX_PATHS];
+    size_t num_paths = split_paths(plot->paths, split, MAX_PATHS);
+    if (num_paths == 0 || open_plot_set(&plot->set, split, num_paths, use_filters, false, verify_reads) != 0) {
+        free(plot->paths);
+        free(plot);
+        return NULL;
+    }
+    return plot;
+}
+
+int pos_plot_map(PosPlot* plot) {
+    return map_plot_set(&plot->set);
+}
+
+void pos_plot_close(PosPlot* plot) {
+    if (!plot) return;
+    close_plot_set(&plot->set);
+    free(plot->paths);
+    free(plot);
+}
+
+PosScratch* pos_scratch_create(void) {
+    PosScratch* scratch = malloc(sizeof(PosScratch));
+    if (!scratch) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    scratch->buffer = lookup_scratch_alloc();
+    if (!scratch->buffer) {
+        free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+void pos_scratch_free(PosScratch* scratch) {
+    if (!scratch) return;
+    free(scratch->buffer);
+    free(scratch);
+}
+
+int pos_lookup(PosPlot* plot, PosScratch* scratch, const uint8_t* hash, int prefix_bytes, Record* found) {
+    if (prefix_bytes < 1 || prefix_bytes > HASH_SIZE) return -1;
+    return search_plot_set_into(&plot->set, hash, prefix_bytes, scratch->buffer, found, NULL);
+}
+
+size_t pos_lookup_batch(PosPlot* plot, PosScratch* scratch, const uint8_t (*hashes)[HASH_SIZE], size_t count, int prefix_bytes, Record* found, bool* hit) {
+    if (prefix_bytes < 1 || prefix_bytes > HASH_SIZE) {
+        memset(hit, 0, count * sizeof(bool));
+        return 0;
+    }
+
+    size_t hits = 0;
+    for (size_t first = 0; first < count; first += LOOKUP_CHUNK_SIZE) {
+        size_t chunk = count - first < LOOKUP_CHUNK_SIZE ? count - first : LOOKUP_CHUNK_SIZE;
+        hits += search_plot_set_many(&plot->set, hashes + first, chunk, prefix_bytes, scratch->buffer, found + first, scratch->status, NULL, NULL);
+        for (size_t i = 0; i < chunk; i++) {
+            hit[first + i] = scratch->status[i] == 1;
+        }
+    }
+    return hits;
+}
+
+int pos_generate(PlotOptions* options, ProgressCallback callback, void* user) {
+    return generate_plot(options, callback, user);
+}
+
+ssize_t pos_verify_checksums(const char* path, int num_threads) {
+    return verify_checksums_file(path, num_threads);
+}
+
+ssize_t pos_verify_sorted(const char* path, size_t* num_unsorted) {
+    ssize_t records = verify_hashes_file(path, num_unsorted, false);
+    return records > 0 ? records : -1;
+}
+
+size_t pos_verify_proofs(const Record* proofs, size_t count, bool* valid, int num_threads) {
+    return verify_records_bulk(proofs, count, valid, num_threads);
+}
+
+int pos_digest(const char* path, uint8_t* digest) {
+    return digest_file(path, digest);
+}
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -8,27 +8,67 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include <time.h>
 
+#include <omp.h>
 
 #include "../BLAKE3/c/blake3.h"
 #include "../include/lookup.h"
 #include "../include/pos.h"
+#include "../include/keys.h"
+#include "../include/layout.h"
+#include "../include/stats.h"
+#include "../include/workload.h"
+
+#ifndef POS_LIBRARY
+static double run_batch(PlotSet* plots, const Workload* workload, int num_threads, LookupMode mode, LookupReport* report) {
+    if (mode == LOOKUP_SCAN) return run_scan_join(plots, workload, num_threads, report);
+    if (mode == LOOKUP_MEMORY) return run_lookups_interleaved(plots, workload, num_threads, report);
+    return run_lookups(plots, workload, num_threads, report);
+}
+
+static void print_help(void) {
+    printf("Help:\n"
+           "  -f <filename>: Specify the output filename, a comma separated list of plots or stripes in bucket order\n"
+           "  -c <num_searches>: Number of searches to perform\n"
+           "  -l <prefix_bytes>: Number of prefix bytes to use\n"
+           "  -t <num_threads>: Number of threads issuing lookups (default: 1)\n"
+           "  -F <bool>: Answer misses from <plot>.filter side files when they exist (default: true)\n"
+           "  -j <file>: Also write the latency report as JSON\n"
+           "  -s <seed>: Seed for the query generator (default: 1)\n"
+           "  -D <dist>: Query distribution, uniform, hotspot[:fraction[:weight]] or zipf[:s] (default: uniform)\n"
+           "  -H <ratio>: Share of queries taken from real nonces so they hit the plot (default: 0)\n"
+           "  -w <trace>: Record the generated queries to a trace file\n"
+           "  -R <trace>: Replay the queries in a trace file instead of generating them\n"
+           "  -C <mode>: Run a cold pass then a warm pass, cold by fadvise (drop cached pages) or direct (O_DIRECT) (default: none)\n"
+           "  -V <bool>: Check every bucket read against the plot's .sums side file (default: false)\n"
+           "  -M <mode>: point lookups, scan (sort the batch and stream each plot once), memory (map the plot, interleave prefetched searches) or auto by batch size (default: auto)\n"
+           "  -h: Display this help message\n");
+}
 
 int main(int argc, char* argv[]) {
-    srand(time(NULL));
 
-    char* filename = "buckets.bin";
+    char default_filename[] = "buckets.bin";
+    char* filename = default_filename;
     int num_searches = 0;
     int prefix_bytes = 0;
-    int num_seeks = 0;
+    int num_threads = 1;
+    bool use_filters = true;
     bool debug = false;
+    char* json_file = NULL;
+    char* record_trace = NULL;
+    char* replay_trace = NULL;
+    bool verify_reads = false;
+    ColdMode cold_mode = COLD_NONE;
+    LookupMode lookup_mode = LOOKUP_AUTO;
+    WorkloadConfig workload_config;
+    workload_defaults(&workload_config);
     int opt;
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-    while (( opt = getopt(argc, argv, "f:c:l:d:h")) != -1) {
+    while (( opt = getopt(argc, argv, "f:c:l:t:F:j:s:D:H:w:R:C:V:M:d:h")) != -1) {
         switch (opt) {
             case 'f':
                 filename = optarg;
@@ -39,155 +79,757 @@ int main(int argc, char* argv[]) {
             case 'l':
                 prefix_bytes = atoi(optarg);
                 break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'F':
+                use_filters = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'j':
+                json_file = optarg;
+                break;
+            case 's':
+                workload_config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                if (parse_distribution(optarg, &workload_config) != 0) {
+                    fprintf(stderr, "Unknown distribution %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                workload_config.hit_ratio = atof(optarg);
+                break;
+            case 'w':
+                record_trace = optarg;
+                break;
+            case 'R':
+                replay_trace = optarg;
+                break;
+            case 'V':
+                verify_reads = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'C':
+                if (strcmp(optarg, "fadvise") == 0) cold_mode = COLD_FADVISE;
+                else if (strcmp(optarg, "direct") == 0) cold_mode = COLD_DIRECT;
+                else if (strcmp(optarg, "none") == 0) cold_mode = COLD_NONE;
+                else {
+                    fprintf(stderr, "Unknown cold mode %s\n", optarg);
+                    print_help();
+                    return 1;
+                }
+                break;
+            case 'M':
+                if (strcmp(optarg, "point") == 0) lookup_mode = LOOKUP_POINT;
+                else if (strcmp(optarg, "scan") == 0) lookup_mode = LOOKUP_SCAN;
+                else if (strcmp(optarg, "memory") == 0) lookup_mode = LOOKUP_MEMORY;
+                else if (strcmp(optarg, "auto") == 0) lookup_mode = LOOKUP_AUTO;
+                else {
+                    fprintf(stderr, "Unknown lookup mode %s\n", optarg);
+                    print_help();
+                    return 1;
+                }
+                break;
             case 'd':
                 debug = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
                 break;
             case 'h':
-                printf("Help:\n"
-                       "  -f <filename>: Specify the output filename\n"
-                       "  -c <num_searches>: Number of searches to perform\n"
-                       "  -l <prefix_bytes>: Number of prefix bytes to use\n"
-                       "  -h: Display this help message\n");
+                print_help();
                 return 0;
             default:
-                printf("Help:\n"
-                       "  -f <filename>: Specify the output filename\n"
-                       "  -c <num_searches>: Number of searches to perform\n"
-                       "  -l <prefix_bytes>: Number of prefix bytes to use\n"
-                       "  -h: Display this help message\n");
-                return 0;
+                print_help();
+                return 1;
         }
     }
 
-    size_t filesize = calc_filesize(filename);
+    char* paths[MAX_PATHS];
+    size_t num_paths = split_paths(filename, paths, MAX_PATHS);
+
+    PlotSet plots;
+    if (open_plot_set(&plots, paths, num_paths, use_filters, cold_mode == COLD_DIRECT, verify_reads) != 0) {
+        return 1;
+    }
 
     if (debug) {
         printf("DEBUG=true\n");
-        printf("FILENAME=%s\n", filename);
+        printf("FILENAME=%s\n", paths[0]);
+        printf("STRIPES=%zu\n", plots.num_stripes);
+        printf("PLOTS=%zu\n", plots.num_plots);
         printf("search_records=%d\n", num_searches);
         printf("prefixLength=%d\n", prefix_bytes);
-        printf("FILESIZE_byte=%zu\n", filesize);
+        printf("THREADS=%d\n", num_threads);
+        for (size_t p = 0; p < plots.num_plots; p++) {
+            if (plots.has_filter[p]) {
+                printf("FILTER[%zu]=%u bits/key, %u prefix bytes\n", p, plots.filters[p].header.bits_per_key, plots.filters[p].header.prefix_bytes);
+            }
+        }
         printf("RECORD_SIZE=%zu\n", sizeof(Record));
         printf("HASH_SIZE=%d\n", HASH_SIZE);
         printf("NONCE_SIZE=%d\n", NONCE_SIZE);
     }
 
-    printf("Searching for random hashes...\n");
+    Workload workload;
+    int loaded = replay_trace ? workload_load(&workload, replay_trace) : workload_generate(&workload, &workload_config, num_searches, prefix_bytes);
+    if (loaded != 0) {
+        close_plot_set(&plots);
+        return 1;
+    }
+    if (replay_trace) {
+        num_searches = workload.count;
+        prefix_bytes = workload.prefix_bytes;
+    }
+    if (record_trace && workload_save(&workload, record_trace) != 0) {
+        workload_free(&workload);
+        close_plot_set(&plots);
+        return 1;
+    }
 
-    int total_found = 0;
-    FILE* file = fopen(filename, "rb");
+    printf("Searching for %s hashes...\n", replay_trace ? "replayed" : "random");
+    if (!replay_trace && workload_config.hit_ratio > 0) {
+        printf("Queries built from real nonces: %zu\n", workload.expected_hits);
+    }
 
-    blake3_hasher hasher;
-    blake3_hasher_init(&hasher);
+    if (lookup_mode == LOOKUP_AUTO) {
+        lookup_mode = prefer_scan_join(workload.count) ? LOOKUP_SCAN : LOOKUP_POINT;
+    }
+    if (lookup_mode == LOOKUP_MEMORY && map_plot_set(&plots) != 0) {
+        workload_free(&workload);
+        close_plot_set(&plots);
+        return 1;
+    }
+    printf("Lookup mode: %s\n", lookup_mode == LOOKUP_SCAN ? "scan join" : lookup_mode == LOOKUP_MEMORY ? "memory" : "point");
 
-    for( int i = 0; i < num_searches; i++) {
-        uint8_t hash[HASH_SIZE];
+    LookupReport reports[2];
+    double elapsed_ms[2];
+    const char* pass_names[2] = {"cold_pass", "warm_pass"};
+    size_t num_passes = cold_mode == COLD_NONE ? 1 : 2;
 
-        uint8_t* random_hash = generate_random_hash(prefix_bytes);
-        if (!random_hash) {
-            fprintf(stderr, "Failed to generate random hash\n");
-            continue;
+    if (cold_mode == COLD_NONE) {
+        elapsed_ms[0] = run_batch(&plots, &workload, num_threads, lookup_mode, &reports[0]);
+    } else {
+        if (cold_mode == COLD_FADVISE && drop_plot_cache(&plots) != 0) {
+            perror("Failed to drop the plot from the page cache");
         }
-        memcpy(hash, random_hash, HASH_SIZE);
-        free(random_hash);
+        plots.direct = cold_mode == COLD_DIRECT;
+        elapsed_ms[0] = run_batch(&plots, &workload, num_threads, lookup_mode, &reports[0]);
+        plots.direct = false;
 
-        Record* record = search_records(file, hash, prefix_bytes, &num_seeks);
-        if (record) {
-            total_found++;
+        if (cold_mode == COLD_DIRECT) { //Direct reads leave nothing cached, so warm the cache with an untimed pass first
+            run_batch(&plots, &workload, num_threads, lookup_mode, &reports[1]);
         }
-        free(record);
+        elapsed_ms[1] = run_batch(&plots, &workload, num_threads, lookup_mode, &reports[1]);
+    }
+
+    workload_free(&workload);
+    close_plot_set(&plots);
+
+    for (size_t pass = 0; pass < num_passes; pass++) {
+        if (num_passes > 1) printf("%s pass:\n", pass == 0 ? "Cold" : "Warm");
+        report_print(&reports[pass], elapsed_ms[pass]);
+    }
+
+    if (json_file && report_write_json(reports, pass_names, elapsed_ms, num_passes, json_file) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+double run_lookups(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report) {
+    struct timespec start_time, end_time;
+    report_init(report);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time); //Only the lookups are timed, not setup
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        LookupReport* local = malloc(sizeof(LookupReport)); //Per thread, merged at the end so recording never contends
+        uint8_t* scratch = lookup_scratch_alloc(); //Every lookup of this thread reads into the same buffer
+        if (local && scratch) {
+            report_init(local);
+
+            #pragma omp for schedule(dynamic, 64)
+            for (size_t i = 0; i < workload->count; i++) {
+                LookupIO io = {0};
+                Record found;
+                struct timespec lookup_start, lookup_end;
+
+                clock_gettime(CLOCK_MONOTONIC, &lookup_start);
+                int hit = search_plot_set_into(plots, workload->queries[i], workload->prefix_bytes, scratch, &found, &io);
+                clock_gettime(CLOCK_MONOTONIC, &lookup_end);
+
+                uint64_t latency_ns = (lookup_end.tv_sec - lookup_start.tv_sec) * 1000000000ULL + (lookup_end.tv_nsec - lookup_start.tv_nsec);
+                report_record(local, latency_ns, io.cold, hit == 1, io.seeks, io.bytes_read);
+            }
+
+            #pragma omp critical(report)
+            report_merge(report, local);
+        } else {
+            fprintf(stderr, "Memory allocation failed for lookup report\n");
+        }
+        free(local);
+        free(scratch);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    return (end_time.tv_sec - start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
+}
+
+double run_lookups_interleaved(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report) {
+    struct timespec start_time, end_time;
+    report_init(report);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        LookupReport* local = malloc(sizeof(LookupReport));
+        uint8_t* scratch = lookup_scratch_alloc(); //Only packed, verified or direct buckets are read into it
+        Record* found = malloc(LOOKUP_CHUNK_SIZE * sizeof(Record));
+        int8_t* status = malloc(LOOKUP_CHUNK_SIZE);
+        LookupIO* io = malloc(LOOKUP_CHUNK_SIZE * sizeof(LookupIO));
+        uint64_t* latency_ns = malloc(LOOKUP_CHUNK_SIZE * sizeof(uint64_t));
+        if (local && scratch && found && status && io && latency_ns) {
+            report_init(local);
+
+            #pragma omp for schedule(dynamic, 1)
+            for (size_t first = 0; first < workload->count; first += LOOKUP_CHUNK_SIZE) {
+                size_t count = workload->count - first < LOOKUP_CHUNK_SIZE ? workload->count - first : LOOKUP_CHUNK_SIZE;
+                search_plot_set_many(plots, workload->queries + first, count, workload->prefix_bytes, scratch, found, status, io, latency_ns);
+                for (size_t i = 0; i < count; i++) {
+                    report_record(local, latency_ns[i], io[i].cold, status[i] == 1, io[i].seeks, io[i].bytes_read);
+                }
+            }
+
+            #pragma omp critical(report)
+            report_merge(report, local);
+        } else {
+            fprintf(stderr, "Memory allocation failed for lookup report\n");
+        }
+        free(local);
+        free(scratch);
+        free(found);
+        free(status);
+        free(io);
+        free(latency_ns);
     }
 
-    fclose(file);
-    
     clock_gettime(CLOCK_MONOTONIC, &end_time);
-    double elapsed_time_ms = (end_time.tv_sec - start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
-    double avg_lookup = elapsed_time_ms / num_searches;
-    printf("Number of total lookups: %d\n", num_searches);
-    printf("Number of records found: %d\n", total_found);
-    printf("Number of total seeks: %d\n", num_seeks);
-    printf("Time taken: %.4f ms/lookup\n", avg_lookup);
-    printf("Throughput: %.2f lookups/s\n", num_searches / (elapsed_time_ms / 1000.0));
+    return (end_time.tv_sec - start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
+}
+
+int open_plot_set(PlotSet* set, char** paths, size_t num_paths, bool use_filters, bool open_direct, bool verify_reads) {
+    set->direct = false;
+    set->num_stripes = 0;
+    set->num_plots = 0;
+    set->plot_first_stripe[0] = 0;
+
+    size_t buckets_in_plot = 0;
+    for (size_t i = 0; i < num_paths; i++) {
+        FILE* file = fopen(paths[i], "rb");
+        if (!file) {
+            perror("Failed to open plot file");
+            close_plot_set(set);
+            return -1;
+        }
+
+        PackedPlot packed;
+        int pack_status = pack_open(&packed, file);
+        size_t filesize = calc_filesize(paths[i]);
+        if (pack_status < 0 || (pack_status == 0 && buckets_in_plot != 0) ||
+            (pack_status == 1 && (filesize == 0 || filesize % BIG_BUCKET_SIZE != 0))) {
+            fprintf(stderr, "File %s is not a whole number of buckets or a whole packed plot\n", paths[i]);
+            if (pack_status == 0) pack_close(&packed);
+            fclose(file);
+            close_plot_set(set);
+            return -1;
+        }
+
+        PlotStripe* stripe = &set->stripes[set->num_stripes++];
+        stripe->file = file;
+        stripe->first_bucket = buckets_in_plot;
+        stripe->num_buckets = pack_status == 0 ? NUM_BUCKETS : filesize / BIG_BUCKET_SIZE;
+        stripe->touched = calloc(stripe->num_buckets, 1);
+        stripe->direct_fd = -1;
+        stripe->packed = NULL;
+        stripe->map = NULL;
+        stripe->map_size = 0;
+        buckets_in_plot += stripe->num_buckets;
 
+        if (pack_status == 0) {
+            stripe->packed = malloc(sizeof(PackedPlot));
+            if (stripe->packed) *stripe->packed = packed;
+            else pack_close(&packed);
+        }
+        if (!stripe->touched || (pack_status == 0 && !stripe->packed)) {
+            fprintf(stderr, "Memory allocation failed\n");
+            close_plot_set(set);
+            return -1;
+        }
+
+        if (open_direct) {
+            stripe->direct_fd = open(paths[i], O_RDONLY | O_DIRECT);
+            if (stripe->direct_fd < 0) {
+                perror("Failed to open plot file with O_DIRECT");
+                close_plot_set(set);
+                return -1;
+            }
+        }
+
+        if (buckets_in_plot > NUM_BUCKETS) {
+            fprintf(stderr, "Stripe %s runs past the last bucket of its plot\n", paths[i]);
+            close_plot_set(set);
+            return -1;
+        }
+        if (buckets_in_plot == NUM_BUCKETS) { //Every stripe for this plot has been seen, the next file starts a new plot
+            size_t p = set->num_plots;
+            const char* first_path = paths[i + 1 - (set->num_stripes - set->plot_first_stripe[p])];
+
+            set->has_filter[p] = false;
+            if (use_filters) {
+                int loaded = filter_load(&set->filters[p], first_path);
+                if (loaded < 0) {
+                    close_plot_set(set);
+                    return -1;
+                }
+                set->has_filter[p] = loaded == 0;
+            }
+
+            set->has_checksums[p] = false;
+            if (verify_reads && !stripe->packed) { //Checksums cover the raw bucket layout
+                int loaded = checksums_load(&set->checksums[p], first_path);
+                if (loaded != 0) {
+                    if (loaded > 0) fprintf(stderr, "No checksums for %s, build it again to verify its reads\n", first_path);
+                    if (set->has_filter[p]) filter_free(&set->filters[p]);
+                    close_plot_set(set);
+                    return -1;
+                }
+                set->has_checksums[p] = true;
+            }
+
+            set->plot_first_stripe[++set->num_plots] = set->num_stripes;
+            buckets_in_plot = 0;
+        }
+    }
+
+    if (buckets_in_plot != 0 || set->num_plots == 0) {
+        fprintf(stderr, "The last plot is missing stripes\n");
+        close_plot_set(set);
+        return -1;
+    }
     return 0;
 }
 
-Record* search_records(FILE* file, const uint8_t* hash, int num_prefix_bytes, int* num_seeks) {
-    uint16_t record_count = 0;
-    Record* records = read_bucket_by_hash(file, hash, num_prefix_bytes, &record_count, num_seeks);
-    if (!records) {
-        fprintf(stderr, "Failed to read records from bucket by hash\n");
+void close_plot_set(PlotSet* set) {
+    for (size_t s = 0; s < set->num_stripes; s++) {
+        fclose(set->stripes[s].file);
+        free(set->stripes[s].touched);
+        if (set->stripes[s].direct_fd >= 0) close(set->stripes[s].direct_fd);
+        if (set->stripes[s].map) munmap((void*)set->stripes[s].map, set->stripes[s].map_size);
+        if (set->stripes[s].packed) {
+            pack_close(set->stripes[s].packed);
+            free(set->stripes[s].packed);
+        }
+    }
+    for (size_t p = 0; p < set->num_plots; p++) {
+        if (set->has_filter[p]) {
+            filter_free(&set->filters[p]);
+            set->has_filter[p] = false;
+        }
+        if (set->has_checksums[p]) {
+            checksums_free(&set->checksums[p]);
+            set->has_checksums[p] = false;
+        }
+    }
+    set->num_stripes = 0;
+    set->num_plots = 0;
+}
+
+int drop_plot_cache(const PlotSet* set) {
+    int status = 0;
+    for (size_t s = 0; s < set->num_stripes; s++) {
+        if (posix_fadvise(fileno(set->stripes[s].file), 0, 0, POSIX_FADV_DONTNEED) != 0) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int map_plot_set(PlotSet* set) {
+    for (size_t s = 0; s < set->num_stripes; s++) {
+        PlotStripe* stripe = &set->stripes[s];
+        if (stripe->packed || stripe->map) continue; //Packed buckets are decoded from reads, there is nothing to search in place
+
+        size_t size = stripe->num_buckets * BIG_BUCKET_SIZE;
+        void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(stripe->file), 0);
+        if (map == MAP_FAILED) {
+            perror("Failed to map plot file");
+            return -1;
+        }
+        madvise(map, size, MADV_RANDOM); //Every probe touches a line or two, readahead around it would only evict other buckets
+        stripe->map = map;
+        stripe->map_size = size;
+    }
+    return 0;
+}
+
+static const uint8_t* read_span_into(int fd, bool direct, off_t offset, size_t size, uint8_t* buffer, LookupIO* io) { //buffer is DIRECT_IO_ALIGN aligned with room for size + 2 * DIRECT_IO_ALIGN, returns where the span starts in it
+    off_t read_offset = offset;
+    size_t read_size = size;
+    if (direct) { //O_DIRECT wants the offset, length and buffer all block aligned, so read the blocks around the span
+        read_offset = offset & ~(off_t)(DIRECT_IO_ALIGN - 1);
+        read_size = (offset - read_offset + size + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+    }
+
+    ssize_t got = pread(fd, buffer, read_size, read_offset); //pread keeps the file position out of it so threads can share the handle
+    if (got < (ssize_t)(offset - read_offset + size)) { //A direct read of the last span can stop short at the end of the file
+        perror("Failed to read bucket");
         return NULL;
     }
-    if (record_count == 0) {
-        free(records);
+
+    if (io) {
+        io->seeks++;
+        io->bytes_read += got;
+    }
+    return buffer + (offset - read_offset);
+}
+
+static uint8_t* read_span(int fd, bool direct, off_t offset, size_t size, const uint8_t** data, LookupIO* io) { //Returns the buffer to free, data points at offset inside it
+    uint8_t* buffer = NULL;
+    if (posix_memalign((void**)&buffer, DIRECT_IO_ALIGN, size + 2 * DIRECT_IO_ALIGN) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    *data = read_span_into(fd, direct, offset, size, buffer, io);
+    if (!*data) {
+        free(buffer);
         return NULL;
     }
+    return buffer;
+}
+
+static Record* copy_record(const Record* record) {
+    Record* copy = malloc(sizeof(Record));
+    if (!copy) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    *copy = *record;
+    return copy;
+}
+
+uint8_t* lookup_scratch_alloc(void) {
+    uint8_t* scratch = NULL;
+    if (posix_memalign((void**)&scratch, DIRECT_IO_ALIGN, LOOKUP_SCRATCH_SIZE) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    return scratch;
+}
+
+int search_plot_set_into(const PlotSet* set, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, LookupIO* io) {
+    size_t bucket_index = bucket_index_for_hash(hash, num_prefix_bytes);
+    int status = 0;
+
+    for (size_t p = 0; p < set->num_plots; p++) {
+        if (set->has_filter[p] && !filter_may_contain(&set->filters[p], bucket_index, hash, num_prefix_bytes)) {
+            continue; //Definitely not in this plot, no need to touch the disk
+        }
+
+        for (size_t s = set->plot_first_stripe[p]; s < set->plot_first_stripe[p + 1]; s++) {
+            const PlotStripe* stripe = &set->stripes[s];
+            if (bucket_index >= stripe->first_bucket + stripe->num_buckets) continue;
+
+            size_t local_bucket = bucket_index - stripe->first_bucket;
+            if (io && (set->direct || !__atomic_exchange_n(&stripe->touched[local_bucket], 1, __ATOMIC_RELAXED))) { //Direct reads skip the page cache, so every one goes to the device
+                io->cold = true;
+            }
+
+            int fd = set->direct ? stripe->direct_fd : fileno(stripe->file);
+            int hit = stripe->packed ? search_packed_bucket_into(fd, set->direct, stripe->packed, local_bucket, hash, num_prefix_bytes, scratch, found, io)
+                                     : search_bucket_into(fd, set->direct, local_bucket, hash, num_prefix_bytes, set->has_checksums[p] ? &set->checksums[p].sums[bucket_index] : NULL, scratch, found, io);
+            if (hit == 1) {
+                return 1;
+            }
+            if (hit < 0) status = -1; //Keep asking the other plots, report the error only if none of them has it
+            break;
+        }
+    }
+    return status;
+}
+
+Record* search_plot_set(const PlotSet* set, const uint8_t* hash, int num_prefix_bytes, LookupIO* io) {
+    uint8_t* scratch = lookup_scratch_alloc();
+    if (!scratch) return NULL;
+
+    Record found;
+    int hit = search_plot_set_into(set, hash, num_prefix_bytes, scratch, &found, io);
+    free(scratch);
+    return hit == 1 ? copy_record(&found) : NULL;
+}
+
+typedef enum {
+    PROBE_EMPTY,
+    PROBE_COUNT, //Bucket header prefetched, read the count next
+    PROBE_SEARCH, //records[mid] prefetched, compare it next
+    PROBE_DESCEND, //Eytzinger bucket, records[k - 1] prefetched, compare it next
+    PROBE_DONE
+} ProbeState;
+
+typedef struct { //One query of the interleaved search, resumed where its last prefetch left it
+    size_t query;
+    size_t bucket_index;
+    size_t plot; //Next plot to ask, queries walk the plots in order like search_plot_set_into
+    const uint8_t* bucket;
+    const Record* records;
+    int left;
+    int right;
+    int mid;
+    size_t k; //Eytzinger slot, counting from 1
+    size_t count;
+    ProbeState state;
+    struct timespec start;
+} ProbeSlot;
+
+static void probe_next_plot(const PlotSet* set, ProbeSlot* slot, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, int8_t* status, LookupIO* io) {
+    for (; slot->plot < set->num_plots; slot->plot++) {
+        size_t p = slot->plot;
+        if (set->has_filter[p] && !filter_may_contain(&set->filters[p], slot->bucket_index, hash, num_prefix_bytes)) {
+            continue;
+        }
+
+        for (size_t s = set->plot_first_stripe[p]; s < set->plot_first_stripe[p + 1]; s++) {
+            const PlotStripe* stripe = &set->stripes[s];
+            if (slot->bucket_index >= stripe->first_bucket + stripe->num_buckets) continue;
+
+            size_t local_bucket = slot->bucket_index - stripe->first_bucket;
+            if (io && (set->direct || !__atomic_exchange_n(&stripe->touched[local_bucket], 1, __ATOMIC_RELAXED))) {
+                io->cold = true;
+            }
+
+            if (stripe->map && !set->direct && !set->has_checksums[p]) { //Searched in place, suspend until the header is in cache
+                slot->bucket = stripe->map + local_bucket * BIG_BUCKET_SIZE;
+                __builtin_prefetch(slot->bucket, 0, 0);
+                slot->state = PROBE_COUNT;
+                return;
+            }
+
+            int fd = set->direct ? stripe->direct_fd : fileno(stripe->file); //Packed, verified or direct buckets go through a read as usual
+            int hit = stripe->packed ? search_packed_bucket_into(fd, set->direct, stripe->packed, local_bucket, hash, num_prefix_bytes, scratch, found, io)
+                                     : search_bucket_into(fd, set->direct, local_bucket, hash, num_prefix_bytes, set->has_checksums[p] ? &set->checksums[p].sums[slot->bucket_index] : NULL, scratch, found, io);
+            if (hit == 1) {
+                *status = 1;
+                slot->state = PROBE_DONE;
+                return;
+            }
+            if (hit < 0) *status = -1;
+            break;
+        }
+    }
+    slot->state = PROBE_DONE;
+}
+
+static void probe_descend(const PlotSet* set, ProbeSlot* slot, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, int8_t* status, LookupIO* io) { //One level of eytzinger_lower_bound
+    if (slot->state == PROBE_DESCEND) {
+        slot->k = 2 * slot->k + (key_compare_prefix(slot->records[slot->k - 1].hash, hash, num_prefix_bytes) < 0);
+    }
+    if (slot->k <= slot->count) {
+        __builtin_prefetch(&slot->records[slot->k - 1], 0, 0);
+        slot->state = PROBE_DESCEND;
+        return;
+    }
+
+    size_t k = slot->k >> (__builtin_ctzll(~(unsigned long long)slot->k) + 1); //Already visited on the way down, so still in cache
+    if (k != 0 && key_compare_prefix(slot->records[k - 1].hash, hash, num_prefix_bytes) == 0) {
+        *found = slot->records[k - 1];
+        *status = 1;
+        slot->state = PROBE_DONE;
+        return;
+    }
+    slot->plot++;
+    probe_next_plot(set, slot, hash, num_prefix_bytes, scratch, found, status, io);
+}
+
+static void probe_step(const PlotSet* set, ProbeSlot* slot, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, int8_t* status, LookupIO* io) {
+    if (slot->state == PROBE_DESCEND) {
+        probe_descend(set, slot, hash, num_prefix_bytes, scratch, found, status, io);
+        return;
+    }
+    if (slot->state == PROBE_COUNT) {
+        size_t record_count = decode_bucket_count(slot->bucket);
+        if (record_count > RECORDS_BIG_BUCKET) {
+            fprintf(stderr, "Invalid record count %zu\n", record_count);
+            *status = -1;
+            record_count = 0;
+        }
+        slot->records = (const Record*)(slot->bucket + BUCKET_HEADER_SIZE);
+        if (decode_bucket_layout(slot->bucket) == BUCKET_LAYOUT_EYTZINGER) {
+            slot->k = 1;
+            slot->count = record_count;
+            probe_descend(set, slot, hash, num_prefix_bytes, scratch, found, status, io);
+            return;
+        }
+        slot->left = 0;
+        slot->right = (int)record_count - 1;
+    } else {
+        int cmp = key_compare_prefix(slot->records[slot->mid].hash, hash, num_prefix_bytes);
+        if (cmp == 0) {
+            *found = slot->records[slot->mid];
+            *status = 1;
+            slot->state = PROBE_DONE;
+            return;
+        }
+        if (cmp < 0) slot->left = slot->mid + 1;
+        else slot->right = slot->mid - 1;
+    }
+
+    if (slot->left > slot->right) { //Not in this plot, ask the next one
+        slot->plot++;
+        probe_next_plot(set, slot, hash, num_prefix_bytes, scratch, found, status, io);
+        return;
+    }
+    slot->mid = slot->left + (slot->right - slot->left) / 2;
+    __builtin_prefetch(&slot->records[slot->mid], 0, 0); //Let the other queries run while this line comes in
+    slot->state = PROBE_SEARCH;
+}
+
+static uint64_t elapsed_ns(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + (now.tv_nsec - start->tv_nsec);
+}
+
+static void probe_admit(const PlotSet* set, ProbeSlot* slot, size_t* next_query, size_t count, const uint8_t (*hashes)[HASH_SIZE], int num_prefix_bytes, uint8_t* scratch,
+                        Record* found, int8_t* status, LookupIO* io, uint64_t* latency_ns) { //Refill a finished slot, queries answered without a probe finish on the spot
+    while (*next_query < count) {
+        size_t q = (*next_query)++;
+        slot->query = q;
+        slot->bucket_index = bucket_index_for_hash(hashes[q], num_prefix_bytes);
+        slot->plot = 0;
+        status[q] = 0;
+        if (io) io[q] = (LookupIO){0};
+        if (latency_ns) clock_gettime(CLOCK_MONOTONIC, &slot->start);
+
+        probe_next_plot(set, slot, hashes[q], num_prefix_bytes, scratch, &found[q], &status[q], io ? &io[q] : NULL);
+        if (slot->state != PROBE_DONE) return;
+        if (latency_ns) latency_ns[q] = elapsed_ns(&slot->start);
+    }
+    slot->state = PROBE_EMPTY;
+}
+
+size_t search_plot_set_many(const PlotSet* set, const uint8_t (*hashes)[HASH_SIZE], size_t count, int num_prefix_bytes, uint8_t* scratch, Record* found, int8_t* status,
+                            LookupIO* io, uint64_t* latency_ns) {
+    ProbeSlot slots[LOOKUP_GROUP_SIZE];
+    size_t next_query = 0;
+    size_t active = 0;
+
+    for (size_t i = 0; i < LOOKUP_GROUP_SIZE; i++) {
+        probe_admit(set, &slots[i], &next_query, count, hashes, num_prefix_bytes, scratch, found, status, io, latency_ns);
+        active += slots[i].state != PROBE_EMPTY;
+    }
+
+    while (active > 0) { //Round robin, by the time a slot comes around again its prefetch has usually landed
+        for (size_t i = 0; i < LOOKUP_GROUP_SIZE; i++) {
+            ProbeSlot* slot = &slots[i];
+            if (slot->state == PROBE_EMPTY) continue;
+
+            size_t q = slot->query;
+            probe_step(set, slot, hashes[q], num_prefix_bytes, scratch, &found[q], &status[q], io ? &io[q] : NULL);
+            if (slot->state != PROBE_DONE) continue;
+
+            if (latency_ns) latency_ns[q] = elapsed_ns(&slot->start);
+            probe_admit(set, slot, &next_query, count, hashes, num_prefix_bytes, scratch, found, status, io, latency_ns);
+            active -= slot->state == PROBE_EMPTY;
+        }
+    }
+
+    size_t hits = 0;
+    for (size_t q = 0; q < count; q++) {
+        hits += status[q] == 1;
+    }
+    return hits;
+}
+
+Record* search_records(FILE* file, const uint8_t* hash, int num_prefix_bytes, LookupIO* io) {
+    return search_bucket(fileno(file), false, bucket_index_for_hash(hash, num_prefix_bytes), hash, num_prefix_bytes, NULL, io);
+}
+
+int search_bucket_into(int fd, bool direct, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, const uint64_t* expected_sum, uint8_t* scratch, Record* found, LookupIO* io) {
+    const uint8_t* bucket = read_span_into(fd, direct, (off_t)bucket_index * BIG_BUCKET_SIZE, BIG_BUCKET_SIZE, scratch, io);
+    if (!bucket) {
+        fprintf(stderr, "Failed to read records from bucket by hash\n");
+        return -1;
+    }
+    if (expected_sum && bucket_checksum(bucket, BIG_BUCKET_SIZE) != *expected_sum) {
+        fprintf(stderr, "Checksum mismatch in bucket %zu\n", bucket_index);
+        return -1;
+    }
+
+    size_t record_count = decode_bucket_count(bucket);
+    if (record_count > RECORDS_BIG_BUCKET) {
+        fprintf(stderr, "Invalid record count %zu\n", record_count);
+        return -1;
+    }
+    const Record* records = (const Record*)(bucket + BUCKET_HEADER_SIZE); //Searched in place, nothing is copied out but the hit
+
+    if (decode_bucket_layout(bucket) == BUCKET_LAYOUT_EYTZINGER) {
+        size_t k = eytzinger_lower_bound(records, record_count, hash, num_prefix_bytes);
+        if (k == 0 || key_compare_prefix(records[k - 1].hash, hash, num_prefix_bytes) != 0) return 0;
+        *found = records[k - 1];
+        return 1;
+    }
 
     int left = 0;
-    int right = record_count - 1;
+    int right = (int)record_count - 1;
     while (left <= right) {
         int mid = left + (right - left) / 2;
-        int cmp = memcmp(records[mid].hash, hash, num_prefix_bytes); //binary search on the big bucket that was pulled into memory
+        int cmp = key_compare_prefix(records[mid].hash, hash, num_prefix_bytes); //binary search on the big bucket that was pulled into memory
 
         if (cmp == 0) {
-            Record* found_record = malloc(sizeof(Record));
-            if (!found_record) {
-                fprintf(stderr, "Memory allocation failed\n");
-                free(records);
-                return NULL;
-            }
-            *found_record = records[mid];
-            free(records);
-            return found_record;
+            *found = records[mid];
+            return 1;
         } else if (cmp < 0) {
             left = mid + 1;
         } else {
             right = mid - 1;
         }
     }
-
-    free(records);
-    return NULL;
+    return 0;
 }
 
+Record* search_bucket(int fd, bool direct, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, const uint64_t* expected_sum, LookupIO* io) {
+    uint8_t* scratch = lookup_scratch_alloc();
+    if (!scratch) return NULL;
 
-Record* read_bucket(FILE* file, size_t bucket_index, uint16_t* record_count, int* num_seeks) {
-    size_t bucket_size = 2 + RECORDS_BIG_BUCKET * sizeof(Record);
-    size_t offset = bucket_index * bucket_size;
+    Record found;
+    int hit = search_bucket_into(fd, direct, bucket_index, hash, num_prefix_bytes, expected_sum, scratch, &found, io);
+    free(scratch);
+    return hit == 1 ? copy_record(&found) : NULL;
+}
 
-    if (fseek(file, offset, SEEK_SET) != 0) {
-        perror("Failed to seek to bucket");
-        return NULL;
-    }
 
-    if (num_seeks) {
-        (*num_seeks)++;
-    } 
+Record* read_bucket(FILE* file, size_t bucket_index, bucket_count_t* record_count, LookupIO* io) {
+    return read_bucket_fd(fileno(file), false, bucket_index, record_count, NULL, io);
+}
+
+Record* read_bucket_fd(int fd, bool direct, size_t bucket_index, bucket_count_t* record_count, const uint64_t* expected_sum, LookupIO* io) {
+    const uint8_t* bucket;
+    uint8_t* buffer = read_span(fd, direct, (off_t)bucket_index * BIG_BUCKET_SIZE, BIG_BUCKET_SIZE, &bucket, io);
+    if (!buffer) return NULL;
 
-    int start = fgetc(file);
-    int end = fgetc(file);
-    if (start == EOF || end == EOF) {
-        perror("Failed to read record count"); 
+    if (expected_sum && bucket_checksum(bucket, BIG_BUCKET_SIZE) != *expected_sum) {
+        fprintf(stderr, "Checksum mismatch in bucket %zu\n", bucket_index);
+        free(buffer);
         return NULL;
     }
 
-    uint16_t count = (uint16_t)(start | (end << 8));
+    size_t count = decode_bucket_count(bucket);
     if (record_count) *record_count = count;
 
     if (count > RECORDS_BIG_BUCKET) {
-        fprintf(stderr, "Invalid record count %u\n", count);
-        return NULL;
-    }
-
-    Record* buffer = malloc(sizeof(Record) * RECORDS_BIG_BUCKET);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
-    }
-
-    if (fread(buffer, sizeof(Record), RECORDS_BIG_BUCKET, file) != RECORDS_BIG_BUCKET) {
-        perror("Failed to read bucket records");
+        fprintf(stderr, "Invalid record count %zu\n", count);
         free(buffer);
         return NULL;
     }
@@ -199,19 +841,230 @@ Record* read_bucket(FILE* file, size_t bucket_index, uint16_t* record_count, int
         return NULL;
     }
 
-    memcpy(valid_records, buffer, count * sizeof(Record));
+    if (decode_bucket_layout(bucket) == BUCKET_LAYOUT_EYTZINGER) eytzinger_to_sorted((const Record*)(bucket + BUCKET_HEADER_SIZE), valid_records, count); //Callers always get key order
+    else memcpy(valid_records, bucket + BUCKET_HEADER_SIZE, count * sizeof(Record));
     free(buffer);
     return valid_records;
 }
 
-Record* read_bucket_by_hash(FILE* file, const uint8_t* hash, int num_prefix_bytes, uint16_t* record_count, int* num_seeks) {
-    uint32_t bucket_i = 0;
-        for (int j = 0; j < num_prefix_bytes; j++) { // convert the prefix into an integer that can be indexed
-            bucket_i = (bucket_i << 8) | hash[j];
+int search_packed_bucket_into(int fd, bool direct, const PackedPlot* packed, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, uint8_t* scratch, Record* found, LookupIO* io) {
+    uint64_t offset = packed->bucket_offsets[bucket_index];
+    size_t size = packed->bucket_offsets[bucket_index + 1] - offset;
+    if (size == 0) return 0;
+    if (size > PACK_MAX_BUCKET_SIZE(RECORDS_BIG_BUCKET)) {
+        fprintf(stderr, "Invalid packed size %zu for bucket %zu\n", size, bucket_index);
+        return -1;
+    }
+
+    const uint8_t* bucket = read_span_into(fd, direct, offset, size, scratch, io);
+    if (!bucket) return -1;
+
+    int hit = pack_search(bucket, size, hash, num_prefix_bytes, found);
+    if (hit < 0) fprintf(stderr, "Packed bucket %zu is corrupt\n", bucket_index);
+    return hit;
+}
+
+Record* search_packed_bucket(int fd, bool direct, const PackedPlot* packed, size_t bucket_index, const uint8_t* hash, int num_prefix_bytes, LookupIO* io) {
+    uint8_t* scratch = lookup_scratch_alloc();
+    if (!scratch) return NULL;
+
+    Record found;
+    int hit = search_packed_bucket_into(fd, direct, packed, bucket_index, hash, num_prefix_bytes, scratch, &found, io);
+    free(scratch);
+    return hit == 1 ? copy_record(&found) : NULL;
+}
+
+static int compare_query_order(const void* a, const void* b, void* arg) { //Queries by prefix, which also puts them in bucket order
+    const Workload* workload = arg;
+    size_t index_a = *(const size_t*)a;
+    size_t index_b = *(const size_t*)b;
+    int cmp = key_compare_prefix(workload->queries[index_a], workload->queries[index_b], workload->prefix_bytes);
+    return cmp != 0 ? cmp : (index_a > index_b) - (index_a < index_b);
+}
+
+static size_t first_query_in_bucket(const size_t* query_buckets, size_t count, size_t bucket) { //Lower bound over the sorted queries
+    size_t left = 0;
+    size_t right = count;
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
+        if (query_buckets[mid] < bucket) left = mid + 1;
+        else right = mid;
+    }
+    return left;
+}
+
+static void join_bucket(const Record* records, size_t count, const Workload* workload, const size_t* order, size_t first, size_t last, uint8_t* found) {
+    size_t r = 0;
+    for (size_t q = first; q < last; q++) { //Both sides are sorted, so the record cursor only moves forward
+        const uint8_t* query = workload->queries[order[q]];
+        while (r < count && key_compare_prefix(records[r].hash, query, workload->prefix_bytes) < 0) r++;
+        if (r == count) break;
+        if (key_compare_prefix(records[r].hash, query, workload->prefix_bytes) == 0) found[order[q]] = 1;
+    }
+}
+
+static int scan_stripe(const PlotSet* set, size_t plot, const PlotStripe* stripe, const Workload* workload, const size_t* order, const size_t* query_buckets,
+                       uint8_t* found, uint64_t* latency_ns, bool* cold, int num_threads, uint64_t* seeks, uint64_t* bytes_read) {
+    size_t chunk_buckets = SCAN_READ_SIZE / BIG_BUCKET_SIZE > 0 ? SCAN_READ_SIZE / BIG_BUCKET_SIZE : 1;
+    size_t num_chunks = (stripe->num_buckets + chunk_buckets - 1) / chunk_buckets;
+    int fd = set->direct ? stripe->direct_fd : fileno(stripe->file);
+    const uint64_t* packed_offsets = stripe->packed ? stripe->packed->bucket_offsets : NULL;
+    uint64_t total_seeks = 0;
+    uint64_t total_bytes = 0;
+    int status = 0;
+
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1) reduction(|:status) reduction(+:total_seeks, total_bytes)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first_local = c * chunk_buckets;
+        size_t last_local = first_local + chunk_buckets < stripe->num_buckets ? first_local + chunk_buckets : stripe->num_buckets;
+        size_t chunk_first_query = first_query_in_bucket(query_buckets, workload->count, stripe->first_bucket + first_local);
+        size_t chunk_last_query = first_query_in_bucket(query_buckets, workload->count, stripe->first_bucket + last_local);
+        if (chunk_first_query == chunk_last_query) continue; //Nothing asked of these buckets, skip the read
+
+        struct timespec chunk_start, chunk_end;
+        clock_gettime(CLOCK_MONOTONIC, &chunk_start);
+
+        bool chunk_cold = set->direct; //Direct reads always reach the device, only the fadvise pass depends on what was touched before
+        for (size_t b = first_local; b < last_local && !set->direct; b++) {
+            if (!__atomic_exchange_n(&stripe->touched[b], 1, __ATOMIC_RELAXED)) chunk_cold = true;
+        }
+
+        LookupIO io = {0};
+        off_t offset = packed_offsets ? (off_t)packed_offsets[first_local] : (off_t)first_local * BIG_BUCKET_SIZE;
+        size_t size = packed_offsets ? packed_offsets[last_local] - packed_offsets[first_local] : (last_local - first_local) * BIG_BUCKET_SIZE;
+        const uint8_t* data;
+        uint8_t* buffer = read_span(fd, set->direct, offset, size, &data, &io);
+        Record* unpacked = malloc(RECORDS_BIG_BUCKET * sizeof(Record)); //Packed buckets are decoded and Eytzinger buckets put in order here
+        if (!buffer || !unpacked) {
+            free(buffer);
+            free(unpacked);
+            status = -1;
+            continue;
+        }
+
+        size_t q = chunk_first_query;
+        for (size_t b = first_local; b < last_local && q < chunk_last_query; b++) {
+            size_t bucket_index = stripe->first_bucket + b;
+            size_t next = q;
+            while (next < chunk_last_query && query_buckets[next] == bucket_index) next++;
+            if (next == q) continue;
+
+            const Record* records;
+            size_t count;
+            if (packed_offsets) {
+                size_t packed_size = packed_offsets[b + 1] - packed_offsets[b];
+                ssize_t unpacked_count = packed_size > 0 ? unpack_bucket(data + (packed_offsets[b] - offset), packed_size, unpacked) : 0;
+                if (unpacked_count < 0) {
+                    fprintf(stderr, "Packed bucket %zu is corrupt\n", bucket_index);
+                    status = -1; //Counted like a failed read
+                    unpacked_count = 0;
+                }
+                count = (size_t)unpacked_count;
+                records = unpacked;
+            } else {
+                const uint8_t* bucket = data + (b - first_local) * BIG_BUCKET_SIZE;
+                count = decode_bucket_count(bucket);
+                records = (const Record*)(bucket + BUCKET_HEADER_SIZE);
+                if (set->has_checksums[plot] && bucket_checksum(bucket, BIG_BUCKET_SIZE) != set->checksums[plot].sums[bucket_index]) {
+                    fprintf(stderr, "Checksum mismatch in bucket %zu\n", bucket_index);
+                    count = 0; //Same as a point lookup, a bad bucket answers nothing
+                } else if (count > RECORDS_BIG_BUCKET) {
+                    fprintf(stderr, "Invalid record count %zu\n", count);
+                    count = 0;
+                } else {
+                    records = bucket_records_sorted(bucket, count, unpacked); //The join walks the records in key order
+                }
+            }
+
+            join_bucket(records, count, workload, order, q, next, found);
+            q = next;
         }
-    bucket_i = ((uint64_t)bucket_i * NUM_BUCKETS) >> (num_prefix_bytes * 8);
 
-    return read_bucket(file, bucket_i, record_count, num_seeks);
+        free(unpacked);
+        free(buffer);
+        clock_gettime(CLOCK_MONOTONIC, &chunk_end);
+
+        uint64_t chunk_ns = (chunk_end.tv_sec - chunk_start.tv_sec) * 1000000000ULL + (chunk_end.tv_nsec - chunk_start.tv_nsec);
+        for (size_t i = chunk_first_query; i < chunk_last_query; i++) { //A query waits for the read and join of its chunk
+            latency_ns[order[i]] += chunk_ns;
+            cold[order[i]] |= chunk_cold;
+        }
+        total_seeks += io.seeks;
+        total_bytes += io.bytes_read;
+    }
+
+    *seeks += total_seeks;
+    *bytes_read += total_bytes;
+    return status;
+}
+
+double run_scan_join(PlotSet* plots, const Workload* workload, int num_threads, LookupReport* report) {
+    struct timespec start_time, end_time;
+    size_t count = workload->count;
+    report_init(report);
+
+    size_t* order = malloc(count * sizeof(size_t));
+    size_t* query_buckets = malloc(count * sizeof(size_t)); //Bucket of each query in sorted order
+    uint8_t* found = calloc(count, sizeof(uint8_t));
+    uint64_t* latency_ns = calloc(count, sizeof(uint64_t));
+    bool* cold = calloc(count, sizeof(bool));
+    if (!order || !query_buckets || !found || !latency_ns || !cold) {
+        fprintf(stderr, "Memory allocation failed for scan join\n");
+        free(order);
+        free(query_buckets);
+        free(found);
+        free(latency_ns);
+        free(cold);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time); //Sorting the batch is part of the work, so it is timed
+
+    for (size_t i = 0; i < count; i++) order[i] = i;
+    qsort_r(order, count, sizeof(size_t), compare_query_order, (void*)workload);
+    for (size_t i = 0; i < count; i++) {
+        query_buckets[i] = bucket_index_for_hash(workload->queries[order[i]], workload->prefix_bytes);
+    }
+
+    uint64_t seeks = 0;
+    uint64_t bytes_read = 0;
+    for (size_t p = 0; p < plots->num_plots; p++) { //Every plot is streamed once from start to end
+        for (size_t s = plots->plot_first_stripe[p]; s < plots->plot_first_stripe[p + 1]; s++) {
+            if (scan_stripe(plots, p, &plots->stripes[s], workload, order, query_buckets, found, latency_ns, cold, num_threads, &seeks, &bytes_read) != 0) {
+                fprintf(stderr, "Failed to scan stripe %zu, its queries count as misses\n", s);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    for (size_t i = 0; i < count; i++) {
+        report_record(report, latency_ns[i], cold[i], found[i], 0, 0);
+    }
+    report->seeks = seeks;
+    report->bytes_read = bytes_read;
+
+    free(order);
+    free(query_buckets);
+    free(found);
+    free(latency_ns);
+    free(cold);
+    return (end_time.tv_sec - start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
+}
+
+bool prefer_scan_join(size_t num_queries) { //Point lookups read a whole bucket per query, a scan reads every bucket once in large sequential reads
+    return num_queries >= NUM_BUCKETS * SCAN_JOIN_MIN_FRACTION;
+}
+
+size_t bucket_index_for_hash(const uint8_t* hash, int num_prefix_bytes) {
+    int bucket_prefix_bytes = calc_prefix_bytes(NUM_BUCKETS);
+    if (num_prefix_bytes > bucket_prefix_bytes) num_prefix_bytes = bucket_prefix_bytes; //Bytes past the bucket prefix would overflow the index
+
+    return key_bucket_index(hash, num_prefix_bytes);
+}
+
+Record* read_bucket_by_hash(FILE* file, const uint8_t* hash, int num_prefix_bytes, bucket_count_t* record_count, LookupIO* io) {
+    return read_bucket(file, bucket_index_for_hash(hash, num_prefix_bytes), record_count, io);
 }
 
 int hexchar_to_int(char c) {
@@ -234,26 +1087,6 @@ int parse_hex_string(const char* hex_str, uint8_t* out_bytes, size_t byte_len) {
     return 1;
 }
 
-uint8_t* generate_random_hash(int prefix_bytes) { //Generates a prefix that can be searched up 
-    if (prefix_bytes < 1 || prefix_bytes > HASH_SIZE) {
-        fprintf(stderr, "Invalid prefix length: %d\n", prefix_bytes);
-        return NULL;
-    }
-
-    uint8_t* hash = calloc(prefix_bytes, sizeof(uint8_t));
-    if (!hash) {
-        fprintf(stderr, "Memory allocation failed for hash\n");
-        return NULL;
-    }
-
-    for (int i = 0; i < prefix_bytes; i++) {
-        hash[i] = rand() & 0xFF;
-    }
-
-    return hash;
-}
-
-
 size_t calc_filesize(const char* filename) {
     FILE* file = fopen(filename, "rb");
     if (!file) {
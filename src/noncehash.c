@@ -0,0 +1,94 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/pos.h"
+#include "../include/noncehash.h"
+
+//A nonce is far shorter than a BLAKE3 block, so its hash is a single compression of one block flagged
+//as chunk start, chunk end and root. The public BLAKE3 API only hashes many inputs at once when they are
+//whole 64 byte blocks, so the single block compression is written out here over HASH_LANES nonces in
+//structure of arrays form. Every step is a loop over the lanes, which the compiler turns into SIMD.
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_ROOT 8
+
+_Static_assert(NONCE_SIZE <= 64 && HASH_SIZE <= 32, "Nonces must fit in one block and hashes in one output");
+
+static const uint32_t BLAKE3_IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+typedef uint32_t lanes_t[HASH_LANES];
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline void g_lanes(lanes_t a, lanes_t b, lanes_t c, lanes_t d, const lanes_t x, const lanes_t y) {
+    for (int l = 0; l < HASH_LANES; l++) {
+        a[l] = a[l] + b[l] + x[l];
+        d[l] = rotr32(d[l] ^ a[l], 16);
+        c[l] = c[l] + d[l];
+        b[l] = rotr32(b[l] ^ c[l], 12);
+        a[l] = a[l] + b[l] + y[l];
+        d[l] = rotr32(d[l] ^ a[l], 8);
+        c[l] = c[l] + d[l];
+        b[l] = rotr32(b[l] ^ c[l], 7);
+    }
+}
+
+void hash_nonces_many(const Record* records, size_t count, uint8_t (*hashes)[HASH_SIZE]) {
+    lanes_t m[16];
+    lanes_t v[16];
+    memset(m, 0, sizeof(m));
+
+    for (size_t l = 0; l < count && l < HASH_LANES; l++) { //Message words are little endian, the rest of the block stays zero
+        for (int i = 0; i < NONCE_SIZE; i++) {
+            m[i / 4][l] |= (uint32_t)records[l].nonce[i] << (8 * (i % 4));
+        }
+    }
+
+    for (int w = 0; w < 8; w++) {
+        for (int l = 0; l < HASH_LANES; l++) v[w][l] = BLAKE3_IV[w];
+    }
+    for (int l = 0; l < HASH_LANES; l++) {
+        v[8][l] = BLAKE3_IV[0];
+        v[9][l] = BLAKE3_IV[1];
+        v[10][l] = BLAKE3_IV[2];
+        v[11][l] = BLAKE3_IV[3];
+        v[12][l] = 0; //Chunk counter
+        v[13][l] = 0;
+        v[14][l] = NONCE_SIZE; //Block length
+        v[15][l] = BLAKE3_CHUNK_START | BLAKE3_CHUNK_END | BLAKE3_ROOT;
+    }
+
+    for (int round = 0; round < 7; round++) {
+        const uint8_t* s = MSG_SCHEDULE[round];
+        g_lanes(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        g_lanes(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        g_lanes(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        g_lanes(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        g_lanes(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        g_lanes(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        g_lanes(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        g_lanes(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (size_t l = 0; l < count && l < HASH_LANES; l++) { //Output word i is v[i] ^ v[i + 8], serialised little endian
+        for (int i = 0; i < HASH_SIZE; i++) {
+            uint32_t word = v[i / 4][l] ^ v[i / 4 + 8][l];
+            hashes[l][i] = (word >> (8 * (i % 4))) & 0xFF;
+        }
+    }
+}
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+
+#include <omp.h>
+
+#include "../include/pos.h"
+#include "../include/keys.h"
+#include "../include/layout.h"
+#include "../include/pack.h"
+
+//A packed bucket is a u32 record count, a directory with one entry per block, then the blocks.
+//Each block holds up to PACK_BLOCK_RECORDS records as: u8 delta width, the first hash in full,
+//the deltas between consecutive hashes bit-packed at that width, then the nonces packed at
+//PACK_NONCE_BITS each. Hashes are treated as 80-bit big-endian integers, sorted buckets make
+//the deltas small so the width is about 80 - K bits instead of 80.
+
+typedef unsigned __int128 hash_value_t;
+
+static hash_value_t hash_value(const uint8_t* hash) {
+    hash_value_t value = 0;
+    for (int i = 0; i < HASH_SIZE; i++) {
+        value = (value << 8) | hash[i];
+    }
+    return value;
+}
+
+static void hash_from_value(hash_value_t value, uint8_t* hash) {
+    for (int i = HASH_SIZE - 1; i >= 0; i--) {
+        hash[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static void put_bits(uint8_t* buffer, size_t bit_pos, uint64_t value, int num_bits) { //LSB first, buffer must start zeroed
+    while (num_bits > 0) {
+        int shift = bit_pos & 7;
+        int take = 8 - shift < num_bits ? 8 - shift : num_bits;
+        buffer[bit_pos >> 3] |= (uint8_t)((value & ((1u << take) - 1)) << shift);
+        value >>= take;
+        bit_pos += take;
+        num_bits -= take;
+    }
+}
+
+static uint64_t get_bits(const uint8_t* buffer, size_t bit_pos, int num_bits) {
+    uint64_t value = 0;
+    int done = 0;
+    while (done < num_bits) {
+        int shift = bit_pos & 7;
+        int take = 8 - shift < num_bits - done ? 8 - shift : num_bits - done;
+        value |= (uint64_t)((buffer[bit_pos >> 3] >> shift) & ((1u << take) - 1)) << done;
+        bit_pos += take;
+        done += take;
+    }
+    return value;
+}
+
+static void put_wide(uint8_t* buffer, size_t bit_pos, hash_value_t value, int num_bits) { //Widths past 64 bits go in two pieces
+    int low_bits = num_bits < 64 ? num_bits : 64;
+    put_bits(buffer, bit_pos, (uint64_t)value, low_bits);
+    if (num_bits > 64) put_bits(buffer, bit_pos + 64, (uint64_t)(value >> 64), num_bits - 64);
+}
+
+static hash_value_t get_wide(const uint8_t* buffer, size_t bit_pos, int num_bits) {
+    int low_bits = num_bits < 64 ? num_bits : 64;
+    hash_value_t value = get_bits(buffer, bit_pos, low_bits);
+    if (num_bits > 64) value |= (hash_value_t)get_bits(buffer, bit_pos + 64, num_bits - 64) << 64;
+    return value;
+}
+
+static uint64_t nonce_value(const uint8_t* nonce) {
+    uint64_t value = 0;
+    for (int i = NONCE_SIZE - 1; i >= 0; i--) {
+        value = (value << 8) | nonce[i];
+    }
+    return value;
+}
+
+static size_t pack_block(const Record* records, size_t count, uint8_t* out) {
+    hash_value_t first = hash_value(records[0].hash);
+    hash_value_t max_delta = 0;
+    hash_value_t prev = first;
+    for (size_t i = 1; i < count; i++) {
+        hash_value_t value = hash_value(records[i].hash);
+        if (value - prev > max_delta) max_delta = value - prev;
+        prev = value;
+    }
+
+    int width = 0;
+    while (width < PACK_HASH_BITS && (max_delta >> width) != 0) width++;
+
+    size_t delta_bytes = ((count - 1) * width + 7) / 8;
+    size_t nonce_bytes = (count * PACK_NONCE_BITS + 7) / 8;
+    memset(out, 0, 1 + HASH_SIZE + delta_bytes + nonce_bytes);
+
+    out[0] = (uint8_t)width;
+    memcpy(out + 1, records[0].hash, HASH_SIZE);
+
+    uint8_t* deltas = out + 1 + HASH_SIZE;
+    prev = first;
+    for (size_t i = 1; i < count; i++) {
+        hash_value_t value = hash_value(records[i].hash);
+        put_wide(deltas, (i - 1) * width, value - prev, width);
+        prev = value;
+    }
+
+    uint8_t* nonces = deltas + delta_bytes;
+    for (size_t i = 0; i < count; i++) {
+        put_bits(nonces, i * PACK_NONCE_BITS, nonce_value(records[i].nonce), PACK_NONCE_BITS);
+    }
+
+    return 1 + HASH_SIZE + delta_bytes + nonce_bytes;
+}
+
+static void unpack_block(const uint8_t* block, size_t count, Record* records) {
+    int width = block[0];
+    const uint8_t* deltas = block + 1 + HASH_SIZE;
+    const uint8_t* nonces = deltas + ((count - 1) * width + 7) / 8;
+
+    hash_value_t value = hash_value(block + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) value += get_wide(deltas, (i - 1) * width, width);
+        hash_from_value(value, records[i].hash);
+        nonce_from_u64(get_bits(nonces, i * PACK_NONCE_BITS, PACK_NONCE_BITS), records[i].nonce);
+    }
+}
+
+static uint32_t read_u32(const uint8_t* bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void write_u32(uint8_t* bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes[i] = (value >> (8 * i)) & 0xFF;
+}
+
+size_t pack_bucket(const Record* records, size_t count, uint8_t* out) {
+    size_t num_blocks = (count + PACK_BLOCK_RECORDS - 1) / PACK_BLOCK_RECORDS;
+    write_u32(out, (uint32_t)count);
+
+    uint8_t* directory = out + PACK_BUCKET_HEADER_SIZE;
+    size_t size = PACK_BUCKET_HEADER_SIZE + num_blocks * PACK_DIR_ENTRY_SIZE;
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t first = block * PACK_BLOCK_RECORDS;
+        size_t in_block = count - first < PACK_BLOCK_RECORDS ? count - first : PACK_BLOCK_RECORDS;
+
+        write_u32(directory + block * PACK_DIR_ENTRY_SIZE, (uint32_t)size);
+        memcpy(directory + block * PACK_DIR_ENTRY_SIZE + 4, records[first].hash, 8);
+        size += pack_block(&records[first], in_block, out + size);
+    }
+    return size;
+}
+
+static ssize_t bucket_count(const uint8_t* bucket, size_t size) { //The record count, or -1 if it or the directory does not fit the bucket
+    if (size < PACK_BUCKET_HEADER_SIZE) return -1;
+    size_t count = read_u32(bucket);
+    size_t num_blocks = (count + PACK_BLOCK_RECORDS - 1) / PACK_BLOCK_RECORDS;
+    if (count > RECORDS_BIG_BUCKET || num_blocks * PACK_DIR_ENTRY_SIZE > size - PACK_BUCKET_HEADER_SIZE) return -1;
+    return (ssize_t)count;
+}
+
+static bool block_fits(const uint8_t* bucket, size_t size, uint32_t offset, size_t count) { //The block's width is sane and all its bytes lie inside the bucket
+    if (offset >= size || bucket[offset] > PACK_HASH_BITS) return false;
+    return PACK_BLOCK_SIZE_AT(count, bucket[offset]) <= size - offset;
+}
+
+ssize_t unpack_bucket(const uint8_t* bucket, size_t size, Record* records) {
+    ssize_t count = bucket_count(bucket, size);
+    if (count < 0) return -1;
+    size_t num_blocks = ((size_t)count + PACK_BLOCK_RECORDS - 1) / PACK_BLOCK_RECORDS;
+
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t first = block * PACK_BLOCK_RECORDS;
+        size_t in_block = (size_t)count - first < PACK_BLOCK_RECORDS ? (size_t)count - first : PACK_BLOCK_RECORDS;
+        uint32_t offset = read_u32(bucket + PACK_BUCKET_HEADER_SIZE + block * PACK_DIR_ENTRY_SIZE);
+        if (!block_fits(bucket, size, offset, in_block)) return -1;
+        unpack_block(bucket + offset, in_block, &records[first]);
+    }
+    return count;
+}
+
+int pack_search(const uint8_t* bucket, size_t size, const uint8_t* hash, int num_prefix_bytes, Record* found) {
+    ssize_t num_records = bucket_count(bucket, size);
+    if (num_records < 0) return -1;
+    size_t count = (size_t)num_records;
+    size_t num_blocks = (count + PACK_BLOCK_RECORDS - 1) / PACK_BLOCK_RECORDS;
+    if (num_blocks == 0) return 0;
+
+    const uint8_t* directory = bucket + PACK_BUCKET_HEADER_SIZE;
+    int key_bytes = num_prefix_bytes < 8 ? num_prefix_bytes : 8;
+    uint64_t query = key_prefix(hash, key_bytes);
+
+    size_t left = 0, right = num_blocks; //First block whose first key is not below the query
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
+        if (key_prefix(directory + mid * PACK_DIR_ENTRY_SIZE + 4, key_bytes) < query) left = mid + 1;
+        else right = mid;
+    }
+
+    size_t block = left;
+    if (block == num_blocks || key_prefix(directory + block * PACK_DIR_ENTRY_SIZE + 4, key_bytes) > query) {
+        if (block == 0) return 0; //Below the first record of the bucket
+        block--; //A match can only be in the tail of the block before
+    }
+
+    Record records[PACK_BLOCK_RECORDS];
+    for (; block < num_blocks; block++) { //Almost always one block, later ones only when a long prefix ties on its first 8 bytes
+        const uint8_t* entry = directory + block * PACK_DIR_ENTRY_SIZE;
+        if (key_prefix(entry + 4, key_bytes) > query) break;
+
+        size_t first = block * PACK_BLOCK_RECORDS;
+        size_t in_block = count - first < PACK_BLOCK_RECORDS ? count - first : PACK_BLOCK_RECORDS;
+        uint32_t offset = read_u32(entry);
+        if (!block_fits(bucket, size, offset, in_block)) return -1;
+        unpack_block(bucket + offset, in_block, records);
+
+        for (size_t i = 0; i < in_block; i++) {
+            int cmp = key_compare_prefix(records[i].hash, hash, num_prefix_bytes);
+            if (cmp == 0) {
+                *found = records[i];
+                return 1;
+            }
+            if (cmp > 0) return 0;
+        }
+    }
+    return 0;
+}
+
+int pack_plot(char** input_files, size_t num_inputs, const char* output_file, int num_threads) {
+    int status = -1;
+    FILE* inputs[MAX_PATHS] = {0};
+    size_t input_first_bucket[MAX_PATHS + 1];
+    FILE* output = NULL;
+    uint64_t* offsets = calloc(NUM_BUCKETS + 1, sizeof(uint64_t));
+    if (!offsets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    input_first_bucket[0] = 0;
+    for (size_t i = 0; i < num_inputs; i++) {
+        inputs[i] = fopen(input_files[i], "rb");
+        if (!inputs[i]) {
+            perror("Failed to open plot file");
+            goto cleanup;
+        }
+        fseek(inputs[i], 0, SEEK_END);
+        long size = ftell(inputs[i]);
+        if (size <= 0 || size % BIG_BUCKET_SIZE != 0) {
+            fprintf(stderr, "File %s is not a whole number of buckets\n", input_files[i]);
+            goto cleanup;
+        }
+        input_first_bucket[i + 1] = input_first_bucket[i] + size / BIG_BUCKET_SIZE;
+    }
+    if (input_first_bucket[num_inputs] != NUM_BUCKETS) {
+        fprintf(stderr, "The stripes hold %zu buckets, a plot has %llu\n", input_first_bucket[num_inputs], NUM_BUCKETS);
+        goto cleanup;
+    }
+
+    output = fopen(output_file, "wb");
+    if (!output) {
+        perror("Failed to open output file");
+        goto cleanup;
+    }
+    setvbuf(output, NULL, _IOFBF, SHARD_IO_BUFFER);
+
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.k = K;
+    header.b = B;
+    header.r = R;
+    header.block_records = PACK_BLOCK_RECORDS;
+    header.num_buckets = NUM_BUCKETS;
+    if (fwrite(&header, sizeof(header), 1, output) != 1) {
+        perror("Failed to write pack header");
+        goto cleanup;
+    }
+
+    uint64_t position = sizeof(header);
+    uint64_t num_records = 0;
+    int failed = 0;
+
+    #pragma omp parallel num_threads(num_threads) reduction(|:failed)
+    {
+        uint8_t* raw = malloc(BIG_BUCKET_SIZE);
+        uint8_t* packed = malloc(PACK_MAX_BUCKET_SIZE(RECORDS_BIG_BUCKET));
+        Record* ordered = malloc(RECORDS_BIG_BUCKET * sizeof(Record)); //Eytzinger buckets are put back in key order, packing needs the deltas
+        if (!raw || !packed || !ordered) failed = 1;
+
+        #pragma omp for ordered schedule(static, 1)
+        for (size_t bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+            size_t packed_size = 0;
+            size_t count = 0;
+            if (raw && packed && ordered && !failed) {
+                size_t i = 0;
+                while (bucket >= input_first_bucket[i + 1]) i++;
+                off_t offset = (off_t)(bucket - input_first_bucket[i]) * BIG_BUCKET_SIZE;
+
+                if (pread(fileno(inputs[i]), raw, BIG_BUCKET_SIZE, offset) != (ssize_t)BIG_BUCKET_SIZE) {
+                    perror("Failed to read bucket");
+                    failed = 1;
+                } else {
+                    count = decode_bucket_count(raw);
+                    if (count > RECORDS_BIG_BUCKET) {
+                        fprintf(stderr, "Invalid count %zu in bucket %zu\n", count, bucket);
+                        failed = 1;
+                    } else {
+                        packed_size = pack_bucket(bucket_records_sorted(raw, count, ordered), count, packed);
+                    }
+                }
+            }
+
+            #pragma omp ordered
+            {
+                offsets[bucket] = position;
+                if (packed_size > 0 && fwrite(packed, 1, packed_size, output) != packed_size) {
+                    perror("Failed to write packed bucket");
+                    failed = 1;
+                }
+                position += packed_size;
+                num_records += count;
+            }
+        }
+
+        free(raw);
+        free(ordered);
+        free(packed);
+    }
+    if (failed) goto cleanup;
+
+    offsets[NUM_BUCKETS] = position;
+    header.num_records = num_records;
+    header.index_offset = position;
+    if (fwrite(offsets, sizeof(uint64_t), NUM_BUCKETS + 1, output) != NUM_BUCKETS + 1 ||
+        fseek(output, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, output) != 1) {
+        perror("Failed to write pack index");
+        goto cleanup;
+    }
+    status = 0;
+
+cleanup:
+    for (size_t i = 0; i < num_inputs; i++) {
+        if (inputs[i]) fclose(inputs[i]);
+    }
+    if (output && fclose(output) != 0) status = -1;
+    free(offsets);
+    return status;
+}
+
+int pack_open(PackedPlot* plot, FILE* file) {
+    plot->bucket_offsets = NULL;
+    if (pread(fileno(file), &plot->header, sizeof(PackHeader), 0) != sizeof(PackHeader) ||
+        memcmp(plot->header.magic, PACK_MAGIC, sizeof(plot->header.magic)) != 0) {
+        return 1;
+    }
+
+    if (plot->header.k != K || plot->header.b != B || plot->header.r != R || plot->header.num_buckets != NUM_BUCKETS || plot->header.block_records != PACK_BLOCK_RECORDS) {
+        fprintf(stderr, "Packed plot was built with K=%u B=%u R=%u, this binary has K=%d B=%d R=%d\n", plot->header.k, plot->header.b, plot->header.r, (int)K, (int)B, (int)R);
+        return -1;
+    }
+
+    plot->bucket_offsets = malloc((NUM_BUCKETS + 1) * sizeof(uint64_t));
+    if (!plot->bucket_offsets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    if (pread(fileno(file), plot->bucket_offsets, (NUM_BUCKETS + 1) * sizeof(uint64_t), plot->header.index_offset) != (ssize_t)((NUM_BUCKETS + 1) * sizeof(uint64_t))) {
+        fprintf(stderr, "Packed plot index is truncated\n");
+        pack_close(plot);
+        return -1;
+    }
+    for (size_t i = 0; i <= NUM_BUCKETS; i++) { //Buckets lie back to back between the header and the index, so every span read from it is bounded
+        uint64_t prev = i == 0 ? sizeof(PackHeader) : plot->bucket_offsets[i - 1];
+        if (plot->bucket_offsets[i] < prev || (i == NUM_BUCKETS && plot->bucket_offsets[i] != plot->header.index_offset)) {
+            fprintf(stderr, "Packed plot index is corrupt at bucket %zu\n", i);
+            pack_close(plot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void pack_close(PackedPlot* plot) {
+    free(plot->bucket_offsets);
+    plot->bucket_offsets = NULL;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <omp.h>
+
+#include "../include/pos.h"
+#include "../include/filter.h"
+#include "../include/pack.h"
+
+int main(int argc, char* argv[]) {
+
+    char default_filename[] = "buckets.bin";
+    char* filename = default_filename;
+    char* output_file = NULL;
+    bool debug = false;
+    int num_threads = 1;
+    int opt;
+
+    while (( opt = getopt(argc, argv, "f:o:t:d:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                filename = optarg;
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'd':
+                debug = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'h':
+                printf("Help:\n"
+                       "  -f <filename>: Plot to pack, a comma separated list gives its stripes in bucket order (default: buckets.bin)\n"
+                       "  -o <filename>: Packed plot to write\n"
+                       "  -t <num_threads>: Threads packing buckets (default: 1)\n"
+                       "  -d <bool>: Enable debug mode\n"
+                       "  -h: Display this help message\n");
+                return 0;
+            default:
+                printf("Help:\n"
+                       "  -f <filename>: Plot to pack, a comma separated list gives its stripes in bucket order (default: buckets.bin)\n"
+                       "  -o <filename>: Packed plot to write\n"
+                       "  -t <num_threads>: Threads packing buckets (default: 1)\n"
+                       "  -d <bool>: Enable debug mode\n"
+                       "  -h: Display this help message\n");
+                return 0;
+        }
+    }
+
+    if (!output_file) {
+        fprintf(stderr, "No output given, use -o\n");
+        return 1;
+    }
+
+    char* input_files[MAX_PATHS];
+    size_t num_inputs = split_paths(filename, input_files, MAX_PATHS);
+    if (num_inputs == 0) {
+        fprintf(stderr, "No plot given, use -f\n");
+        return 1;
+    }
+
+    if (debug) {
+        printf("FILENAME=%s\n", input_files[0]);
+        printf("STRIPES=%zu\n", num_inputs);
+        printf("OUTPUT=%s\n", output_file);
+        printf("BLOCK_RECORDS=%d\n", PACK_BLOCK_RECORDS);
+        printf("BUCKETS=%lld\n", NUM_BUCKETS);
+    }
+
+    double start_time = omp_get_wtime();
+
+    if (pack_plot(input_files, num_inputs, output_file, num_threads) != 0) {
+        fprintf(stderr, "Failed to pack plot\n");
+        return 1;
+    }
+
+    BucketFilter filter = {0}; //Filters are indexed by bucket only, so the raw plot's filter serves the packed one as is
+    int loaded = filter_load(&filter, input_files[0]);
+    if (loaded == 0) {
+        if (filter_save(&filter, output_file) != 0) {
+            fprintf(stderr, "Failed to write the filter\n");
+        }
+        filter_free(&filter);
+    }
+
+    FILE* out_final = fopen(output_file, "rb+");
+    if (out_final) {
+        fsync(fileno(out_final));
+        fclose(out_final);
+    }
+
+    double total_time = omp_get_wtime() - start_time;
+    size_t raw_size = NUM_BUCKETS * BIG_BUCKET_SIZE;
+    struct stat packed_stat;
+    size_t packed_size = stat(output_file, &packed_stat) == 0 ? (size_t)packed_stat.st_size : 0;
+
+    printf("Packed %s (%zu stripes) into %s in %.2f seconds : %.1f MB -> %.1f MB (%.1f%%)\n", input_files[0], num_inputs, output_file,
+        total_time, raw_size / 1e6, packed_size / 1e6, 100.0 * packed_size / raw_size);
+    return 0;
+}
@@ -1,15 +1,87 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <omp.h>
 
 #include "../BLAKE3/c/blake3.h"
 #include "../include/pos.h"
+#include "../include/keys.h"
+#include "../include/layout.h"
+#include "../include/filter.h"
+#include "../include/checksum.h"
+#include "../include/trace.h"
+#include "../include/noncehash.h"
+
+void encode_bucket_count(uint8_t* header, size_t count) {
+    memset(header, 0, BUCKET_HEADER_SIZE);
+    for (size_t i = 0; i < COUNT_BITS / 8; i++) {
+        header[i] = (count >> (8 * i)) & 0xFF;
+    }
+}
+
+size_t decode_bucket_count(const uint8_t* header) {
+    size_t count = 0;
+    for (size_t i = COUNT_BITS / 8; i > 0; i--) {
+        count = (count << 8) | header[i - 1];
+    }
+    return EYTZINGER_SUPPORTED ? count & ~BUCKET_EYTZINGER_FLAG : count;
+}
+
+void encode_bucket_header(uint8_t* header, size_t count, BucketLayout layout) {
+    encode_bucket_count(header, layout == BUCKET_LAYOUT_EYTZINGER ? count | BUCKET_EYTZINGER_FLAG : count);
+}
+
+BucketLayout decode_bucket_layout(const uint8_t* header) {
+    if (!EYTZINGER_SUPPORTED) return BUCKET_LAYOUT_SORTED;
+    return (header[(COUNT_BITS - 1) / 8] & (1 << ((COUNT_BITS - 1) % 8))) ? BUCKET_LAYOUT_EYTZINGER : BUCKET_LAYOUT_SORTED;
+}
 
-static size_t total_bucket_flushes = 0;
+int write_bucket_count(FILE* file, size_t count) {
+    return write_bucket_header(file, count, BUCKET_LAYOUT_SORTED);
+}
+
+int write_bucket_header(FILE* file, size_t count, BucketLayout layout) {
+    uint8_t header[BUCKET_HEADER_SIZE];
+    encode_bucket_header(header, count, layout);
+    return fwrite(header, 1, BUCKET_HEADER_SIZE, file) == BUCKET_HEADER_SIZE ? 0 : -1;
+}
+
+void progress_init(Progress* progress, ProgressCallback callback, void* user) {
+    progress->callback = callback;
+    progress->user = user;
+    progress->start_time = omp_get_wtime();
+    progress->last_report = progress->start_time;
+    progress->count = 0;
+}
+
+void progress_update(Progress* progress, const char* stage, const char* unit, size_t done, size_t total, double mb_done) {
+    if (!progress || !progress->callback) return;
+
+    double now = omp_get_wtime();
+    if (now - progress->last_report < PRINT_TIME) return;
+
+    progress->count++;
+    progress->last_report = now;
+    ProgressInfo info = {stage, unit, done, total, mb_done, now - progress->start_time, progress->count};
+    progress->callback(&info, progress->user);
+}
+
+void progress_print(const ProgressInfo* info, void* user) {
+    (void)user;
+    double percent = (100.0 * info->done) / info->total;
+    double eta = info->elapsed * (info->total - info->done) / (info->done + 1e-5);
+    printf("[%d][%s]: %.2f%% completed, ETA %.1f seconds, %zu/%zu %s, %.1f MB/sec\n",
+        info->count, info->stage, percent, eta, info->done, info->total, info->unit, info->mb_done / info->elapsed);
+    fflush(stdout);
+}
 
 void increment_nonce(uint8_t *nonce, size_t nonce_size){
     for (size_t i = 0; i < nonce_size; i++) {
@@ -19,20 +91,43 @@ void increment_nonce(uint8_t *nonce, size_t nonce_size){
     }
 }
 
-void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucket* buckets, size_t records_batch, double* last_print, uint64_t records_generated, bool debug) {
-    omp_lock_t bucket_locks[NUM_BUCKETS];
+static void sift_down_by_nonce(Record* records, size_t count, size_t slot) { //Restore the max-heap on nonce below slot
+    Record moving = records[slot];
+    uint64_t nonce = nonce_to_u64(moving.nonce);
+    for (;;) {
+        size_t child = 2 * slot + 1;
+        if (child >= count) break;
+        uint64_t child_nonce = nonce_to_u64(records[child].nonce);
+        if (child + 1 < count) {
+            uint64_t right_nonce = nonce_to_u64(records[child + 1].nonce);
+            if (right_nonce > child_nonce) {
+                child++;
+                child_nonce = right_nonce;
+            }
+        }
+        if (child_nonce <= nonce) break;
+        records[slot] = records[child];
+        slot = child;
+    }
+    records[slot] = moving;
+}
 
-    size_t total_flushes = NUM_BATCHES * NUM_BUCKETS;
-    
-    static double start_time = 0;
-    if (start_time == 0) start_time = omp_get_wtime();
-    static int print_count = 0;
+static void heapify_by_nonce(Record* records, size_t count) {
+    for (size_t slot = count / 2; slot-- > 0;) {
+        sift_down_by_nonce(records, count, slot);
+    }
+}
+
+void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucket* buckets, size_t records_batch, size_t records_generated, Progress* progress) {
+    omp_lock_t bucket_locks[NUM_BUCKETS];
 
     for (int i = 0; i < NUM_BUCKETS; i++) {
         omp_init_lock(&bucket_locks[i]);
         buckets[i].record_count = 0;
     }
 
+    uint64_t first_nonce = nonce_to_u64(starting_nonce);
+
     #pragma omp parallel
     {
         blake3_hasher hasher;
@@ -49,6 +144,7 @@ void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucke
             increment_nonce(local_nonce, NONCE_SIZE);
         }
 
+        TRACE_BEGIN(hash);
         for (size_t i = start; i < end; i++) {
             uint8_t hash[HASH_SIZE];
             Record record;
@@ -57,42 +153,32 @@ void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucke
             blake3_hasher_update(&hasher, local_nonce, NONCE_SIZE);
             blake3_hasher_finalize(&hasher, hash, HASH_SIZE);
 
-            uint32_t prefix = 0;
-            for (int j = 0; j < num_prefix_bytes; j++) {
-                prefix = (prefix << 8) | hash[j];
-            }
-
-            uint32_t bucket_i = ((uint64_t)prefix * NUM_BUCKETS) >> (num_prefix_bytes * 8);
+            uint32_t bucket_i = key_bucket_index(hash, num_prefix_bytes);
             if (bucket_i >= NUM_BUCKETS) bucket_i = NUM_BUCKETS - 1;
 
             memcpy(record.hash, hash, HASH_SIZE);
             memcpy(record.nonce, local_nonce, NONCE_SIZE);
 
-            omp_set_lock(&bucket_locks[bucket_i]);
-            if (buckets[bucket_i].record_count < MAX_RECORDS_PER_BUCKET) {
-                buckets[bucket_i].records[buckets[bucket_i].record_count++] = record;
+            TRACE_SET_LOCK(&bucket_locks[bucket_i], "bucket_lock_wait");
+            Bucket* bucket = &buckets[bucket_i];
+            if (bucket->record_count < MAX_RECORDS_PER_BUCKET) {
+                bucket->records[bucket->record_count++] = record;
+                if (bucket->record_count == MAX_RECORDS_PER_BUCKET) {
+                    heapify_by_nonce(bucket->records, MAX_RECORDS_PER_BUCKET);
+                }
+            } else if (first_nonce + i < nonce_to_u64(bucket->records[0].nonce)) { //A full bucket keeps the lowest nonces whatever order the threads arrive in
+                bucket->records[0] = record; //Replace the highest nonce at the heap's root
+                sift_down_by_nonce(bucket->records, MAX_RECORDS_PER_BUCKET, 0);
             }
             omp_unset_lock(&bucket_locks[bucket_i]);
 
             increment_nonce(local_nonce, NONCE_SIZE);
-            if (debug && tid == 0) {
-                double now = omp_get_wtime();
-                double interval = now - *last_print;
-                if (interval >= PRINT_TIME) {
-                    double elapsed = now - start_time;
-                    double percent = (100.0 * (records_generated + i - start)) / NUM_RECORDS;
-                    double eta = elapsed * (NUM_RECORDS - (records_generated + i - start)) / ((records_generated + i - start) + 1e-5);
-                    double mb_done = (records_generated + i) * sizeof(Record) / 1e6;
-                    double mb_per_sec = mb_done / elapsed;
-
-                    print_count++;
-                    printf("[%d][HASHGEN]: %.2f%% completed, ETA %.1f seconds, %zu/%zu flushes, %.1f MB/sec\n",
-                        print_count, percent, eta, total_bucket_flushes, total_flushes, mb_per_sec);
-                    fflush(stdout);
-                    *last_print = now;
-                }
+            if (progress && tid == 0) { //Only one thread reports, so the progress needs no lock
+                size_t done = records_generated + i - start;
+                progress_update(progress, "HASHGEN", "records", done, NUM_RECORDS, done * sizeof(Record) / 1e6);
             }
         }
+        TRACE_END(hash, "hash_batch");
     }
 
     for (int i = 0; i < NUM_BUCKETS; i++) {
@@ -101,257 +187,1006 @@ void generate_records(const uint8_t* starting_nonce, int num_prefix_bytes, Bucke
 }
 
 
-int dump_buckets(Bucket* buckets, size_t num_buckets, const char* filename) { 
-    FILE* file = fopen(filename, "ab");
+static void encode_temp_record(const Record* record, uint64_t first_nonce, uint8_t* out) {
+    memcpy(out, record->hash + TEMP_HASH_SKIP, HASH_SIZE - TEMP_HASH_SKIP);
+    uint64_t offset = nonce_to_u64(record->nonce) - first_nonce;
+    for (int i = 0; i < TEMP_OFFSET_SIZE; i++) {
+        out[HASH_SIZE - TEMP_HASH_SKIP + i] = (uint8_t)(offset >> (8 * i));
+    }
+}
+
+static void decode_temp_record(const uint8_t* in, size_t bucket_index, uint64_t first_nonce, Record* record) {
+    for (int i = 0; i < TEMP_HASH_SKIP; i++) { //The bucket index is the top B bits of the hash
+        record->hash[i] = (uint8_t)(bucket_index >> (B - 8 * (i + 1)));
+    }
+    memcpy(record->hash + TEMP_HASH_SKIP, in, HASH_SIZE - TEMP_HASH_SKIP);
+    uint64_t offset = 0;
+    for (int i = 0; i < TEMP_OFFSET_SIZE; i++) {
+        offset |= (uint64_t)in[HASH_SIZE - TEMP_HASH_SKIP + i] << (8 * i);
+    }
+    nonce_from_u64(first_nonce + offset, record->nonce);
+}
+
+static int dump_bucket_range(Bucket* buckets, size_t first_bucket, size_t end_bucket, const uint32_t* starts, uint64_t first_nonce, const char* filename, long offset) {
+    FILE* file = fopen(filename, "r+b"); //The temp file is preallocated, so each batch is written in place
     
     if (!file) {
         perror("Failed to open the file.");
         return -1;
     }
+
+    if (fseek(file, offset + (long)(TEMP_BATCH_HEADER_SIZE + (size_t)starts[first_bucket] * TEMP_RECORD_SIZE), SEEK_SET) != 0) {
+        perror("Failed to seek to the batch.");
+        fclose(file);
+        return -1;
+    }
+
+    uint8_t* packed = malloc(MAX_RECORDS_PER_BUCKET * TEMP_RECORD_SIZE);
+    if (!packed) {
+        fprintf(stderr, "Failed to allocate the temp record buffer\n");
+        fclose(file);
+        return -1;
+    }
     
-    for (size_t i = 0; i < num_buckets; i++) { //Write the files into memory with the count first. Looking back I probably could have dumped the whole struct, but I wanted to be safe.
+    for (size_t i = first_bucket; i < end_bucket; i++) { //The offset table holds the counts, so the buckets follow each other with no header or padding
         Bucket* bucket = &buckets[i];
 
-        uint16_t count = bucket->record_count;
-
-        fputc(count & 0xFF, file);
-        fputc((count >> 8) & 0xFF, file);
+        size_t count = bucket->record_count;
+        for (size_t r = 0; r < count; r++) {
+            encode_temp_record(&bucket->records[r], first_nonce, &packed[r * TEMP_RECORD_SIZE]);
+        }
 
-        size_t written = fwrite(bucket->records, sizeof(Record), count, file);
+        size_t written = fwrite(packed, TEMP_RECORD_SIZE, count, file);
 
         if (written != count) {
             perror("Failed to write records to file.");
+            free(packed);
             fclose(file);
             return -1;
         }
+    }
 
-        size_t padding = MAX_RECORDS_PER_BUCKET - count;
-        Record empty_record = {0};
+    free(packed);
+    fclose(file);
+    return 0;
+}
 
-        for (size_t j = 0; j < padding; j++) { //add padding
-            if( fwrite(&empty_record, sizeof(Record), 1, file) != 1) {
-                perror("Failed to write padding records to file.");
-                fclose(file);
-                return -1;
-            }
+static int write_temp_batch_header(const TempBatchHeader* header, const uint32_t* starts, size_t num_buckets, const char* filename, long offset) {
+    FILE* file = fopen(filename, "r+b");
+    if (!file) {
+        perror("Failed to open the file.");
+        return -1;
+    }
+
+    int status = 0;
+    if (fseek(file, offset, SEEK_SET) != 0 || fwrite(header, sizeof(TempBatchHeader), 1, file) != 1 || fwrite(starts, sizeof(uint32_t), num_buckets + 1, file) != num_buckets + 1) {
+        perror("Failed to write the batch offset table.");
+        status = -1;
+    }
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+int dump_buckets(Bucket* buckets, size_t num_buckets, uint64_t first_nonce, const char* filename, long offset, int num_threads_write, size_t* batch_size) {
+    uint32_t* starts = malloc((num_buckets + 1) * sizeof(uint32_t)); //Offset table, bucket b is records starts[b] to starts[b + 1] of the batch
+    if (!starts) {
+        fprintf(stderr, "Failed to allocate the batch offset table\n");
+        return -1;
+    }
+    starts[0] = 0;
+    for (size_t b = 0; b < num_buckets; b++) {
+        starts[b + 1] = starts[b] + buckets[b].record_count;
+    }
+
+    TempBatchHeader header = {
+        .first_nonce = first_nonce,
+        .size = TEMP_BATCH_HEADER_SIZE + (size_t)starts[num_buckets] * TEMP_RECORD_SIZE,
+    };
+    int status = write_temp_batch_header(&header, starts, num_buckets, filename, offset);
+
+    #pragma omp parallel for num_threads(num_threads_write) schedule(static, 1) reduction(|:status)
+    for (int t = 0; t < num_threads_write; t++) { //Each writer gets its own handle and a contiguous range of buckets
+        size_t first_bucket = num_buckets * t / num_threads_write;
+        size_t end_bucket = num_buckets * (t + 1) / num_threads_write;
+        TRACE_BEGIN(dump);
+        if (first_bucket < end_bucket && dump_bucket_range(buckets, first_bucket, end_bucket, starts, first_nonce, filename, offset) != 0) {
+            status = -1;
         }
+        TRACE_END(dump, "dump");
     }
 
-    fclose(file);
+    free(starts);
+    if (batch_size) *batch_size = header.size;
+    return status;
+}
 
-    #pragma omp atomic
-    total_bucket_flushes += num_buckets;
+static int load_temp_tables(FILE** inputs, char** input_files, size_t num_inputs, size_t num_batches, long* batch_offsets, uint64_t* first_nonces, uint32_t* starts) { //Walk the batches of every temp file and keep their offset tables
+    for (size_t f = 0; f < num_inputs; f++) {
+        fseek(inputs[f], 0, SEEK_END);
+        long file_size = ftell(inputs[f]);
+        long offset = 0;
+
+        for (size_t batch = f; batch < num_batches; batch += num_inputs) { //Batches were dealt round robin across the temp files
+            TempBatchHeader header;
+            uint32_t* table = &starts[batch * (NUM_BUCKETS + 1)];
+            if (fseek(inputs[f], offset, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, inputs[f]) != 1 || fread(table, sizeof(uint32_t), NUM_BUCKETS + 1, inputs[f]) != NUM_BUCKETS + 1) {
+                fprintf(stderr, "Failed to read the header of batch %zu from %s\n", batch, input_files[f]);
+                return -1;
+            }
+
+            bool valid = table[0] == 0 && header.size == TEMP_BATCH_HEADER_SIZE + (uint64_t)table[NUM_BUCKETS] * TEMP_RECORD_SIZE && header.size <= (uint64_t)(file_size - offset);
+            for (size_t b = 0; b < NUM_BUCKETS && valid; b++) {
+                valid = table[b] <= table[b + 1] && table[b + 1] - table[b] <= MAX_RECORDS_PER_BUCKET;
+            }
+            if (!valid) {
+                fprintf(stderr, "Batch %zu in %s has a corrupt offset table\n", batch, input_files[f]);
+                return -1;
+            }
 
+            batch_offsets[batch] = offset;
+            first_nonces[batch] = header.first_nonce;
+            offset += header.size;
+        }
+    }
     return 0;
 }
 
-void merge_and_sort_buckets(const char* input_file, const char* output_file, int num_threads_sort) {
+int merge_and_sort_buckets(char** input_files, size_t num_inputs, char** output_files, size_t num_outputs, size_t num_batches, const ShardHeader* shard, BucketFilter* filter, BucketChecksums* checksums, BucketLayout layout, int num_threads_sort, Progress* progress) {
     const size_t record_size = sizeof(Record);
-    const size_t bucket_header_size = 2;
-    const size_t bucket_size = bucket_header_size + (MAX_RECORDS_PER_BUCKET * record_size);
-    const size_t total_batches = NUM_BATCHES;
+    const size_t bucket_header_size = BUCKET_HEADER_SIZE;
+    const size_t total_batches = num_batches;
     const size_t max_records_per_bucket = MAX_RECORDS_PER_BUCKET * total_batches;
-    Record empty_record = {0};
 
-    FILE* input = fopen(input_file, "rb");
-    if (!input) {
-        perror("Failed to open input file");
-        return;
+    FILE* inputs[MAX_PATHS];
+    omp_lock_t input_locks[MAX_PATHS]; //One lock per temp file so reads from different scratch devices can overlap
+    for (size_t f = 0; f < num_inputs; f++) {
+        inputs[f] = fopen(input_files[f], "rb");
+        if (!inputs[f]) {
+            perror("Failed to open input file");
+            while (f > 0) fclose(inputs[--f]);
+            return -1;
+        }
     }
 
-    fseek(input, 0, SEEK_END);
-    long file_size = ftell(input);
-    fseek(input, 0, SEEK_SET);
-    
-    if (file_size != (long)(total_batches * NUM_BUCKETS * bucket_size)) {
-        fprintf(stderr, "Input file size doesn't match expected size\n");
-        fclose(input);
-        return;
+    long* batch_offsets = malloc(total_batches * sizeof(long));
+    uint64_t* first_nonces = malloc(total_batches * sizeof(uint64_t));
+    uint32_t* batch_starts = malloc(total_batches * (NUM_BUCKETS + 1) * sizeof(uint32_t)); //Every batch's offset table, so a segment is found without touching the disk
+    if (!batch_offsets || !first_nonces || !batch_starts || load_temp_tables(inputs, input_files, num_inputs, total_batches, batch_offsets, first_nonces, batch_starts) != 0) {
+        if (!batch_offsets || !first_nonces || !batch_starts) fprintf(stderr, "Failed to allocate the batch offset tables\n");
+        free(batch_offsets); free(first_nonces); free(batch_starts);
+        for (size_t f = 0; f < num_inputs; f++) fclose(inputs[f]);
+        return -1;
     }
 
-    FILE* output = fopen(output_file, "wb");
-    if (!output) {
-        perror("Failed to open output file");
-        fclose(input);
-        return;
+    for (size_t f = 0; f < num_inputs; f++) {
+        omp_init_lock(&input_locks[f]);
     }
 
-    static double start_time = 0;
-    if (start_time == 0) start_time = omp_get_wtime();
-    double last_print = start_time;
-    static int print_count = 0;
+    FILE* outputs[MAX_PATHS];
+    size_t* order = malloc((NUM_BUCKETS + num_outputs + 1) * sizeof(size_t)); //Buckets dealt round robin across the stripes so every device is written at once
+    if (!order || open_output_stripes(output_files, num_outputs, bucket_header_size + max_records_per_bucket * record_size, shard ? sizeof(ShardHeader) : 0, outputs) != 0) {
+        if (!order) fprintf(stderr, "Failed to allocate the bucket order\n");
+        for (size_t f = 0; f < num_inputs; f++) {
+            omp_destroy_lock(&input_locks[f]);
+            fclose(inputs[f]);
+        }
+        free(batch_offsets); free(first_nonces); free(batch_starts); free(order);
+        return -1;
+    }
+    stripe_chunk_order(0, NUM_BUCKETS, 1, num_outputs, order);
+
+    int status = 0; //Set by any bucket that fails, the rest are skipped
+    if (shard && fwrite(shard, sizeof(ShardHeader), 1, outputs[0]) != 1) {
+        perror("Failed to write shard header");
+        status = -1;
+    }
 
     size_t sorted_count = 0;
 
     #pragma omp parallel for num_threads(num_threads_sort) ordered schedule(static, 1)
-    for (size_t bucket_index = 0; bucket_index < NUM_BUCKETS; bucket_index++) {
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        size_t bucket_index = order[i];
+        int failed;
+        #pragma omp atomic read
+        failed = status;
+        if (failed != 0) continue;
+
         Record* buffer = malloc(max_records_per_bucket * sizeof(Record));
-        if (!buffer) {
+        Record* sorted = malloc(max_records_per_bucket * sizeof(Record));
+        uint64_t* keys = malloc(max_records_per_bucket * sizeof(uint64_t));
+        uint8_t* packed = malloc(MAX_RECORDS_PER_BUCKET * TEMP_RECORD_SIZE);
+        if (!buffer || !sorted || !keys || !packed) {
             fprintf(stderr, "Failed to malloc record buffer for bucket %zu\n", bucket_index);
+            free(buffer); free(sorted); free(keys); free(packed);
+            #pragma omp atomic write
+            status = -1;
             continue;
         }
 
         size_t total_records = 0;
+        bool read_ok = true;
 
         for (size_t batch = 0; batch < total_batches; batch++) {
-            size_t offset = batch * (NUM_BUCKETS * bucket_size) + bucket_index * bucket_size;
-
-            uint8_t count_bytes[2];
-            uint16_t count = 0;
+            size_t f = batch % num_inputs; //Batches were dealt round robin across the temp files
+            const uint32_t* starts = &batch_starts[batch * (NUM_BUCKETS + 1)];
+            size_t count = starts[bucket_index + 1] - starts[bucket_index];
+            long offset = batch_offsets[batch] + (long)(TEMP_BATCH_HEADER_SIZE + (size_t)starts[bucket_index] * TEMP_RECORD_SIZE);
+            FILE* input = inputs[f];
+            if (count == 0) continue;
+
+            TRACE_SET_LOCK(&input_locks[f], "temp_lock_wait");
+            TRACE_BEGIN(read);
+            if (fseek(input, offset, SEEK_SET) != 0) {
+                fprintf(stderr, "Failed to seek to position %ld\n", offset);
+                count = 0;
+                read_ok = false;
+            } else if (fread(packed, TEMP_RECORD_SIZE, count, input) != count) {
+                fprintf(stderr, "Failed to read records for batch %zu bucket %zu\n", batch, bucket_index);
+                count = 0;
+                read_ok = false;
+            }
+            TRACE_END(read, "segment_read");
+            omp_unset_lock(&input_locks[f]);
 
-            #pragma omp critical(file_read)
-            {
-                if (fseek(input, offset, SEEK_SET) != 0) {
-                    fprintf(stderr, "Failed to seek to position %zu\n", offset);
-                    count = 0;
-                } else if (fread(count_bytes, 1, 2, input) != 2) {
-                    fprintf(stderr, "Failed to read count for batch %zu bucket %zu\n", batch, bucket_index);
-                    count = 0;
-                } else {
-                    count = count_bytes[0] | (count_bytes[1] << 8);
-                    
-                    if (count > MAX_RECORDS_PER_BUCKET) {
-                        fprintf(stderr, "Invalid count %u in batch %zu bucket %zu\n", count, batch, bucket_index);
-                        count = 0;
-                    } else if (count > 0) {
-                        if (fread(&buffer[total_records], record_size, count, input) != count) {
-                            fprintf(stderr, "Failed to read records for batch %zu bucket %zu\n", batch, bucket_index);
-                            count = 0;
-                        } else {
-                            total_records += count;
-                        }
-                    }
-                }
-                
-                if (count < MAX_RECORDS_PER_BUCKET) {
-                    fseek(input, (MAX_RECORDS_PER_BUCKET - count) * record_size, SEEK_CUR);
-                }
+            for (size_t r = 0; r < count; r++) { //Decoded outside the lock, the next reader is already waiting
+                decode_temp_record(&packed[r * TEMP_RECORD_SIZE], bucket_index, first_nonces[batch], &buffer[total_records + r]);
             }
+            total_records += count;
+        }
+        free(packed);
+        if (!read_ok) {
+            free(buffer); free(sorted); free(keys);
+            #pragma omp atomic write
+            status = -1;
+            continue;
         }
 
-        if (total_records > 1) {
-            qsort(buffer, total_records, sizeof(Record), compare_records);
+        TRACE_BEGIN(sort);
+        sort_records_by_key(buffer, total_records, sorted, keys);
+        if (filter) {
+            filter_add_bucket(filter, bucket_index, sorted, total_records);
+        }
+        const Record* stored = sorted;
+        if (layout == BUCKET_LAYOUT_EYTZINGER) { //The unsorted records are no longer needed, lay the tree out over them
+            eytzinger_from_sorted(sorted, buffer, total_records);
+            stored = buffer;
         }
+        if (checksums) {
+            checksums_add_bucket(checksums, bucket_index, stored, total_records, layout);
+        }
+        TRACE_END(sort, "sort");
 
+        TRACE_BEGIN(ordered);
         #pragma omp ordered
         {
-            fputc(total_records & 0xFF, output);
-            fputc((total_records >> 8) & 0xFF, output);
-
-            if (total_records > 0) {
-                fwrite(buffer, record_size, total_records, output);
-            }
-
-            size_t padding = max_records_per_bucket - total_records;
-            for (size_t j = 0; j < padding; j++) {
-                fwrite(&empty_record, record_size, 1, output);
+            TRACE_END(ordered, "ordered_wait");
+            TRACE_BEGIN(write);
+            FILE* output = outputs[stripe_of_bucket(bucket_index, num_outputs)];
+
+            if (write_bucket_header(output, total_records, layout) != 0 ||
+                fwrite(stored, record_size, total_records, output) != total_records ||
+                skip_padding(output, max_records_per_bucket - total_records) != 0) {
+                fprintf(stderr, "Failed to write bucket %zu: %s\n", bucket_index, strerror(errno));
+                #pragma omp atomic write
+                status = -1;
             }
+            TRACE_END(write, "ordered_write");
         }
 
         free(buffer);
+        free(sorted);
+        free(keys);
 
         #pragma omp atomic
         sorted_count++;
 
         #pragma omp critical(progress)
-        {
-            double now = omp_get_wtime();
-            double interval = now - last_print;
-            if (interval >= PRINT_TIME) {
-                double elapsed = now - start_time;
-                double percent = (100.0 * sorted_count) / NUM_BUCKETS;
-                double eta = elapsed * (NUM_BUCKETS - sorted_count) / (sorted_count + 1e-5);
-                double mb_done = sorted_count * max_records_per_bucket * record_size / 1e6;
-                double mb_per_sec = mb_done / elapsed;
+        progress_update(progress, "SORTMERGE", "buckets", sorted_count, NUM_BUCKETS, sorted_count * max_records_per_bucket * record_size / 1e6);
+    }
 
-                print_count++;
-                printf("[%d][SORTMERGE]: %.2f%% completed, ETA %.1f seconds, %zu/%zu buckets, %.1f MB/sec\n",
-                    print_count, percent, eta, sorted_count, (size_t)NUM_BUCKETS, mb_per_sec);
-                fflush(stdout);
-                last_print = now;
+    for (size_t f = 0; f < num_inputs; f++) {
+        omp_destroy_lock(&input_locks[f]);
+        fclose(inputs[f]);
+    }
+    for (size_t s = 0; s < num_outputs; s++) {
+        if (fclose(outputs[s]) != 0) {
+            perror("Failed to close output stripe");
+            status = -1;
+        }
+    }
+    free(batch_offsets);
+    free(first_nonces);
+    free(batch_starts);
+    free(order);
+    return status;
+}
+
+static void hash_nonce_group(uint64_t first_nonce, size_t count, Record* group) { //Up to HASH_LANES consecutive nonces through the SIMD BLAKE3 lanes
+    uint8_t hashes[HASH_LANES][HASH_SIZE];
+    for (size_t l = 0; l < count; l++) {
+        nonce_from_u64(first_nonce + l, group[l].nonce);
+    }
+    hash_nonces_many(group, count, hashes);
+    for (size_t l = 0; l < count; l++) {
+        memcpy(group[l].hash, hashes[l], HASH_SIZE);
+    }
+}
+
+size_t image_buckets(size_t image_bytes) {
+    size_t buckets = image_bytes / BIG_BUCKET_SIZE;
+    if (buckets == 0) buckets = 1;
+    return buckets < NUM_BUCKETS ? buckets : NUM_BUCKETS;
+}
+
+size_t in_memory_plot_mb(uint64_t num_nonces, int num_threads) {
+    size_t arena = num_nonces * sizeof(Record);
+    size_t tables = (size_t)(2 * num_threads + 1) * NUM_BUCKETS * sizeof(size_t);
+    size_t sort_scratch = (size_t)num_threads * (image_buckets(INMEM_WRITE_SIZE) * BIG_BUCKET_SIZE + RECORDS_BIG_BUCKET * (sizeof(Record) + sizeof(uint64_t)));
+    return (arena + tables + sort_scratch) / (1024 * 1024);
+}
+
+static size_t recompute_fixed_bytes(int num_threads_hash, int num_threads_sort) { //Per-thread tables and sort buffers, plus one bucket of image per sort thread and of arena
+    size_t tables = (size_t)(2 * num_threads_hash + 1) * NUM_BUCKETS * sizeof(size_t);
+    size_t sort_buffers = (size_t)num_threads_sort * (BIG_BUCKET_SIZE + RECORDS_BIG_BUCKET * (sizeof(Record) + sizeof(uint64_t)));
+    return tables + sort_buffers + RECORDS_BIG_BUCKET * sizeof(Record);
+}
+
+size_t recompute_min_mb(int num_threads_hash, int num_threads_sort) {
+    return (recompute_fixed_bytes(num_threads_hash, num_threads_sort) + (1024 * 1024 - 1)) / (1024 * 1024);
+}
+
+size_t recompute_pass_records(int memory_mb, int num_threads_hash, int num_threads_sort, size_t* chunk_buckets) {
+    size_t budget = (size_t)memory_mb * 1024 * 1024;
+    size_t fixed = recompute_fixed_bytes(num_threads_hash, num_threads_sort);
+    if (budget < fixed) return 0;
+
+    size_t spare = budget - fixed; //At most a quarter of what is left widens the write images, the arena gets the rest since every pass rehashes the plot
+    size_t image_bytes = BIG_BUCKET_SIZE + spare / (4 * (size_t)num_threads_sort);
+    *chunk_buckets = image_buckets(image_bytes < INMEM_WRITE_SIZE ? image_bytes : INMEM_WRITE_SIZE);
+    return (spare - (size_t)num_threads_sort * (*chunk_buckets - 1) * BIG_BUCKET_SIZE) / sizeof(Record) + RECORDS_BIG_BUCKET;
+}
+
+static void count_buckets(uint64_t start_nonce, uint64_t num_nonces, int num_prefix_bytes, size_t* limits, int num_threads, Progress* progress) { //Row t of limits ends up as the records thread t keeps per bucket
+    #pragma omp parallel num_threads(num_threads) //Each thread hashes a contiguous range of nonces
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        uint64_t first = num_nonces * tid / nthreads;
+        uint64_t end = num_nonces * (tid + 1) / nthreads;
+        size_t* counts = &limits[(size_t)tid * NUM_BUCKETS];
+        Record group[HASH_LANES];
+
+        TRACE_BEGIN(count);
+        for (uint64_t i = first; i < end; i += HASH_LANES) {
+            size_t in_group = end - i < HASH_LANES ? end - i : HASH_LANES;
+            hash_nonce_group(start_nonce + i, in_group, group);
+            for (size_t l = 0; l < in_group; l++) {
+                counts[key_bucket_index(group[l].hash, num_prefix_bytes)]++;
             }
+            if (tid == 0) progress_update(progress, "COUNT", "records", i * nthreads, num_nonces, i * nthreads * sizeof(Record) / 1e6);
         }
+        TRACE_END(count, "count_pass");
     }
 
-    fclose(input);
-    fclose(output);
+    for (size_t b = 0; b < NUM_BUCKETS; b++) { //Threads hold ascending nonce ranges, so giving the bucket's room to the lower threads first keeps the lowest nonces
+        size_t room = RECORDS_BIG_BUCKET;
+        for (int t = 0; t < num_threads; t++) {
+            size_t* count = &limits[(size_t)t * NUM_BUCKETS + b];
+            if (*count > room) *count = room;
+            room -= *count;
+        }
+    }
 }
 
-void sort_buckets_in_memory(Bucket* buckets, const char* output_file) {
-    FILE* out = fopen(output_file, "wb");
-    if (!out) {
-        perror("Failed to open output file for writing");
-        return;
+static void scatter_range(uint64_t start_nonce, uint64_t num_nonces, int num_prefix_bytes, size_t first_bucket, size_t end_bucket, size_t* limits, size_t* cursors, Record* arena,
+                          int num_threads, size_t pass, size_t num_passes, Progress* progress) { //Hash every nonce again, keep the records of buckets in the range
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        uint64_t first = num_nonces * tid / nthreads;
+        uint64_t end = num_nonces * (tid + 1) / nthreads;
+        size_t* room = &limits[(size_t)tid * NUM_BUCKETS];
+        size_t* cursor = &cursors[(size_t)tid * NUM_BUCKETS];
+        Record group[HASH_LANES];
+
+        TRACE_BEGIN(scatter);
+        for (uint64_t i = first; i < end; i += HASH_LANES) {
+            size_t in_group = end - i < HASH_LANES ? end - i : HASH_LANES;
+            hash_nonce_group(start_nonce + i, in_group, group);
+            for (size_t l = 0; l < in_group; l++) {
+                size_t b = key_bucket_index(group[l].hash, num_prefix_bytes);
+                if (b < first_bucket || b >= end_bucket || room[b] == 0) continue; //Another pass owns it, or the bucket is already full of lower nonces
+                room[b]--;
+                arena[cursor[b]++] = group[l];
+            }
+            if (tid == 0) {
+                size_t done = pass * num_nonces + i * nthreads;
+                progress_update(progress, "HASHGEN", "records", done, num_passes * num_nonces, done * sizeof(Record) / 1e6);
+            }
+        }
+        TRACE_END(scatter, "scatter_pass");
     }
+}
 
-    Record empty_record = {0};
+static int write_range(const Record* arena, const size_t* bucket_starts, size_t first_bucket, size_t end_bucket, size_t chunk_buckets, FILE** outputs, size_t num_outputs,
+                       BucketFilter* filter, BucketChecksums* checksums, BucketLayout layout, int num_threads, Progress* progress) { //Sort each bucket of the range and write whole bucket images in order
+    if (chunk_buckets > end_bucket - first_bucket) chunk_buckets = end_bucket - first_bucket; //No image larger than the range it writes
+    size_t* chunks = malloc(((end_bucket - first_bucket) / chunk_buckets + num_outputs + 1) * sizeof(size_t));
+    if (!chunks) {
+        fprintf(stderr, "Failed to allocate the chunk order\n");
+        return -1;
+    }
+    size_t num_chunks = stripe_chunk_order(first_bucket, end_bucket, chunk_buckets, num_outputs, chunks);
+    size_t written = first_bucket;
+    int status = 0;
 
-    static double start_time = 0;
-    if (start_time == 0) start_time = omp_get_wtime();
-    double last_print = start_time;
-    static int print_count = 0;
+    #pragma omp parallel num_threads(num_threads) reduction(|:status)
+    {
+        uint8_t* image = malloc(chunk_buckets * BIG_BUCKET_SIZE); //Whole bucket images for one chunk, padding included, written in one go
+        Record* sorted = malloc(RECORDS_BIG_BUCKET * sizeof(Record));
+        uint64_t* keys = malloc(RECORDS_BIG_BUCKET * sizeof(uint64_t));
+        if (!image || !sorted || !keys) {
+            fprintf(stderr, "Failed to allocate sort buffers\n");
+            status = -1;
+        }
 
-    size_t completed = 0;
+        #pragma omp for ordered schedule(static, 1)
+        for (size_t c = 0; c < num_chunks; c++) {
+            size_t chunk_first = chunks[c];
+            size_t chunk_end = stripe_chunk_end(chunk_first, end_bucket, chunk_buckets, num_outputs);
+
+            TRACE_BEGIN(sort);
+            if (image && sorted && keys) {
+                memset(image, 0, (chunk_end - chunk_first) * BIG_BUCKET_SIZE);
+                for (size_t b = chunk_first; b < chunk_end; b++) {
+                    size_t count = bucket_starts[b + 1] - bucket_starts[b]; //Already capped at the bucket size by count_buckets
+
+                    uint8_t* bucket = image + (b - chunk_first) * BIG_BUCKET_SIZE;
+                    sort_records_by_key(&arena[bucket_starts[b]], count, sorted, keys);
+                    encode_bucket_header(bucket, count, layout);
+                    if (layout == BUCKET_LAYOUT_EYTZINGER) eytzinger_from_sorted(sorted, (Record*)(bucket + BUCKET_HEADER_SIZE), count);
+                    else memcpy(bucket + BUCKET_HEADER_SIZE, sorted, count * sizeof(Record));
+
+                    if (filter) filter_add_bucket(filter, b, sorted, count);
+                    if (checksums) checksums_add_bucket(checksums, b, (const Record*)(bucket + BUCKET_HEADER_SIZE), count, layout);
+                }
+            }
+            TRACE_END(sort, "sort");
 
-    #pragma omp parallel for ordered schedule(static, 1)
-    for (size_t i = 0; i < NUM_BUCKETS; i++) {
-        Bucket* bucket = &buckets[i];
+            TRACE_BEGIN(ordered);
+            #pragma omp ordered
+            {
+                TRACE_END(ordered, "ordered_wait");
+                TRACE_BEGIN(write);
+                size_t chunk_size = (chunk_end - chunk_first) * BIG_BUCKET_SIZE;
+                if (image && sorted && keys && fwrite(image, 1, chunk_size, outputs[stripe_of_bucket(chunk_first, num_outputs)]) != chunk_size) { //A chunk never crosses a stripe
+                    perror("Failed to write buckets");
+                    status = -1;
+                }
+
+                written += chunk_end - chunk_first;
+                progress_update(progress, "INMEM_SORT", "buckets", written, NUM_BUCKETS, written * BIG_BUCKET_SIZE / 1e6);
+                TRACE_END(write, "ordered_write");
+            }
+        }
+
+        free(image);
+        free(sorted);
+        free(keys);
+    }
+    free(chunks);
+    return status;
+}
+
+int generate_plot_in_passes(uint64_t start_nonce, uint64_t num_nonces, char** output_files, size_t num_outputs, BucketFilter* filter, BucketChecksums* checksums, BucketLayout layout,
+                            size_t max_pass_records, size_t chunk_buckets, int num_threads_hash, int num_threads_sort, Progress* progress, size_t* num_passes) {
+    if (max_pass_records < RECORDS_BIG_BUCKET) {
+        fprintf(stderr, "A pass must hold at least one full bucket of %llu records\n", (unsigned long long)RECORDS_BIG_BUCKET);
+        return -1;
+    }
+
+    int num_prefix_bytes = calc_prefix_bytes(NUM_BUCKETS);
+    size_t* limits = calloc((size_t)num_threads_hash * NUM_BUCKETS, sizeof(size_t)); //Row t: records thread t keeps per bucket, counted down as it scatters
+    size_t* cursors = malloc((size_t)num_threads_hash * NUM_BUCKETS * sizeof(size_t)); //Row t: where thread t writes its next record of each bucket
+    size_t* bucket_starts = malloc((NUM_BUCKETS + 1) * sizeof(size_t));
+    if (!limits || !cursors || !bucket_starts) {
+        fprintf(stderr, "Failed to allocate the bucket tables\n");
+        free(limits); free(cursors); free(bucket_starts);
+        return -1;
+    }
+
+    count_buckets(start_nonce, num_nonces, num_prefix_bytes, limits, num_threads_hash, progress);
 
-        if (bucket->record_count > 1) {
-            qsort(bucket->records, bucket->record_count, sizeof(Record), compare_records);
+    size_t passes = 0; //Plan the bucket ranges up front so the progress knows how many hashing passes remain
+    size_t arena_records = 0;
+    for (size_t b = 0, held = 0; b < NUM_BUCKETS; b++) {
+        size_t kept = 0;
+        for (int t = 0; t < num_threads_hash; t++) kept += limits[(size_t)t * NUM_BUCKETS + b];
+        if (b == 0 || held + kept > max_pass_records) {
+            passes++;
+            held = 0;
         }
+        held += kept;
+        if (held > arena_records) arena_records = held;
+    }
+    if (num_passes) *num_passes = passes;
 
-        #pragma omp ordered
-        {
+    Record* arena = malloc((arena_records > 0 ? arena_records : 1) * sizeof(Record)); //One pass worth of records, buckets back to back with no padding
+    FILE* outputs[MAX_PATHS];
+    if (!arena || open_output_stripes(output_files, num_outputs, BIG_BUCKET_SIZE, 0, outputs) != 0) {
+        if (!arena) fprintf(stderr, "Failed to allocate the pass arena\n");
+        free(limits); free(cursors); free(bucket_starts); free(arena);
+        return -1;
+    }
 
-            fputc(bucket->record_count & 0xFF, out);
-            fputc((bucket->record_count >> 8) & 0xFF, out);
+    int status = 0;
+    size_t first_bucket = 0;
+    for (size_t pass = 0; pass < passes && status == 0; pass++) {
+        size_t end_bucket = first_bucket;
+        size_t offset = 0;
+        while (end_bucket < NUM_BUCKETS) { //Same greedy split as the plan
+            size_t kept = 0;
+            for (int t = 0; t < num_threads_hash; t++) kept += limits[(size_t)t * NUM_BUCKETS + end_bucket];
+            if (end_bucket > first_bucket && offset + kept > max_pass_records) break;
+
+            bucket_starts[end_bucket] = offset; //Bucket b holds thread 0's records, then thread 1's, so within a bucket the nonces stay in order
+            for (int t = 0; t < num_threads_hash; t++) {
+                cursors[(size_t)t * NUM_BUCKETS + end_bucket] = offset;
+                offset += limits[(size_t)t * NUM_BUCKETS + end_bucket];
+            }
+            end_bucket++;
+        }
+        bucket_starts[end_bucket] = offset;
 
+        scatter_range(start_nonce, num_nonces, num_prefix_bytes, first_bucket, end_bucket, limits, cursors, arena, num_threads_hash, pass, passes, progress);
+        status = write_range(arena, bucket_starts, first_bucket, end_bucket, chunk_buckets, outputs, num_outputs, filter, checksums, layout, num_threads_sort, progress);
+        first_bucket = end_bucket;
+    }
 
-            if (bucket->record_count > 0) {
-                fwrite(bucket->records, sizeof(Record), bucket->record_count, out);
+    for (size_t s = 0; s < num_outputs; s++) {
+        fclose(outputs[s]);
+    }
+    free(limits);
+    free(cursors);
+    free(bucket_starts);
+    free(arena);
+    return status;
+}
+
+int generate_plot_in_memory(uint64_t start_nonce, uint64_t num_nonces, char** output_files, size_t num_outputs, BucketFilter* filter, BucketChecksums* checksums, BucketLayout layout, int num_threads_hash, int num_threads_sort, Progress* progress) {
+    return generate_plot_in_passes(start_nonce, num_nonces, output_files, num_outputs, filter, checksums, layout, SIZE_MAX, image_buckets(INMEM_WRITE_SIZE), num_threads_hash, num_threads_sort, progress, NULL);
+}
+
+int preallocate_file(FILE* file, off_t size) {
+    int fd = fileno(file);
+    if (size == 0) { //A scratch directory past the last batch gets an empty temp file, fallocate rejects a zero length
+        return 0;
+    }
+    if (fallocate(fd, 0, 0, size) == 0) { //Unwritten extents read back as zeros without the zeros ever hitting the device
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -1;
+    }
+    return ftruncate(fd, size); //No fallocate on this filesystem, leave holes instead
+}
+
+int skip_padding(FILE* file, size_t num_records) {
+    if (num_records == 0) return 0;
+    return fseek(file, num_records * sizeof(Record), SEEK_CUR);
+}
+
+int open_output_stripes(char** output_files, size_t num_outputs, size_t bucket_size, size_t header_size, FILE** outputs) {
+    for (size_t s = 0; s < num_outputs; s++) { //Each stripe holds a contiguous range of buckets
+        outputs[s] = fopen(output_files[s], "wb");
+        if (!outputs[s]) {
+            perror("Failed to open output file");
+            while (s > 0) {
+                fclose(outputs[--s]);
+                outputs[s] = NULL; //Callers may clean up the array themselves
             }
+            return -1;
+        }
+
+        size_t stripe_buckets = stripe_first_bucket(s + 1, num_outputs) - stripe_first_bucket(s, num_outputs);
+        off_t stripe_size = stripe_buckets * bucket_size + (s == 0 ? header_size : 0);
+        if (preallocate_file(outputs[s], stripe_size) != 0) {
+            perror("Failed to preallocate output file");
+            fclose(outputs[s]);
+            outputs[s] = NULL;
+            while (s > 0) {
+                fclose(outputs[--s]);
+                outputs[s] = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+size_t split_paths(char* list, char** paths, size_t max_paths) {
+    size_t count = 0;
+    char* saveptr = NULL;
+    for (char* path = strtok_r(list, ",", &saveptr); path && count < max_paths; path = strtok_r(NULL, ",", &saveptr)) {
+        paths[count++] = path;
+    }
+    return count;
+}
+
+size_t temp_batches_in_file(size_t file_index, size_t num_temp_files, size_t num_batches) {
+    return (num_batches + num_temp_files - 1 - file_index) / num_temp_files;
+}
+
+int make_temp_paths(char** dirs, size_t num_dirs, char** temp_files) {
+    for (size_t i = 0; i < num_dirs; i++) {
+        size_t len = strlen(dirs[i]) + strlen(TEMP_FILE) + 32;
+        temp_files[i] = malloc(len);
+        if (!temp_files[i]) {
+            fprintf(stderr, "Failed to allocate temp file path\n");
+            free_temp_paths(temp_files, i);
+            return -1;
+        }
+        snprintf(temp_files[i], len, "%s/%s.%zu", dirs[i], TEMP_FILE, i); //The index keeps names unique if a directory is listed twice
+    }
+    return 0;
+}
+
+void free_temp_paths(char** temp_files, size_t num_temp_files) {
+    for (size_t i = 0; i < num_temp_files; i++) {
+        free(temp_files[i]);
+    }
+}
 
+size_t stripe_first_bucket(size_t stripe, size_t num_stripes) { //Buckets are split as evenly as possible, earlier stripes get the smaller share
+    return (size_t)(((uint64_t)stripe * NUM_BUCKETS) / num_stripes);
+}
+
+size_t stripe_of_bucket(size_t bucket_index, size_t num_stripes) {
+    return (size_t)((((uint64_t)bucket_index + 1) * num_stripes - 1) / NUM_BUCKETS);
+}
 
-            size_t padding = MAX_RECORDS_PER_BUCKET - bucket->record_count;
-            for (size_t j = 0; j < padding; j++) {
-                fwrite(&empty_record, sizeof(Record), 1, out);
+size_t stripe_chunk_order(size_t first_bucket, size_t end_bucket, size_t chunk_buckets, size_t num_stripes, size_t* chunks) { //Round r takes the r-th chunk of every stripe's share of the range
+    size_t count = 0;
+    for (size_t round = 0, added = 1; added > 0; round++) {
+        added = 0;
+        for (size_t s = 0; s < num_stripes; s++) {
+            size_t lo = stripe_first_bucket(s, num_stripes) > first_bucket ? stripe_first_bucket(s, num_stripes) : first_bucket;
+            size_t hi = stripe_first_bucket(s + 1, num_stripes) < end_bucket ? stripe_first_bucket(s + 1, num_stripes) : end_bucket;
+            if (lo + round * chunk_buckets < hi) {
+                chunks[count++] = lo + round * chunk_buckets;
+                added++;
             }
         }
+    }
+    return count;
+}
 
+size_t stripe_chunk_end(size_t chunk_first, size_t end_bucket, size_t chunk_buckets, size_t num_stripes) {
+    size_t end = chunk_first + chunk_buckets;
+    size_t stripe_end = stripe_first_bucket(stripe_of_bucket(chunk_first, num_stripes) + 1, num_stripes);
+    if (end > stripe_end) end = stripe_end;
+    return end < end_bucket ? end : end_bucket;
+}
 
-        #pragma omp atomic
-        completed++;
+void nonce_from_u64(uint64_t value, uint8_t* nonce) {
+    for (size_t i = 0; i < NONCE_SIZE; i++) {
+        nonce[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
 
-        #pragma omp critical
-        {
+uint64_t nonce_to_u64(const uint8_t* nonce) {
+    uint64_t value = 0;
+    for (int i = NONCE_SIZE - 1; i >= 0; i--) {
+        value = (value << 8) | nonce[i];
+    }
+    return value;
+}
+
+void init_shard_header(ShardHeader* header, uint64_t start_nonce, uint64_t num_nonces, size_t num_batches) {
+    memset(header, 0, sizeof(ShardHeader));
+    memcpy(header->magic, SHARD_MAGIC, sizeof(header->magic));
+    header->start_nonce = start_nonce;
+    header->num_nonces = num_nonces;
+    header->k = K;
+    header->b = B;
+    header->r = R;
+    header->records_per_bucket = num_batches * MAX_RECORDS_PER_BUCKET;
+}
+
+int read_shard_header(FILE* file, ShardHeader* header) {
+    if (fread(header, sizeof(ShardHeader), 1, file) != 1) {
+        perror("Failed to read shard header");
+        return -1;
+    }
+    if (memcmp(header->magic, SHARD_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Not a shard file\n");
+        return -1;
+    }
+    if (header->k != K || header->b != B || header->r != R) {
+        fprintf(stderr, "Shard was built with K=%u B=%u R=%u\n", header->k, header->b, header->r);
+        return -1;
+    }
+    if (header->records_per_bucket == 0 || header->records_per_bucket > RECORDS_BIG_BUCKET) {
+        fprintf(stderr, "Invalid shard bucket size %u\n", header->records_per_bucket);
+        return -1;
+    }
+    return 0;
+}
+
+int read_plot_as_shard(FILE* file, const char* filename, ShardHeader* header) {
+    if (fseek(file, 0, SEEK_END) != 0) {
+        perror("Failed to seek plot");
+        return -1;
+    }
+    long file_size = ftell(file);
+    rewind(file);
+
+    size_t bucket_size = file_size > 0 ? (size_t)file_size / NUM_BUCKETS : 0;
+    size_t capacity = bucket_size > BUCKET_HEADER_SIZE ? (bucket_size - BUCKET_HEADER_SIZE) / sizeof(Record) : 0;
+    if (file_size <= 0 || (size_t)file_size != NUM_BUCKETS * bucket_size || bucket_size != BUCKET_HEADER_SIZE + capacity * sizeof(Record) ||
+        capacity == 0 || capacity > RECORDS_BIG_BUCKET || capacity % MAX_RECORDS_PER_BUCKET != 0) {
+        fprintf(stderr, "Not a shard or a plot with %llu buckets of this R and at most this K\n", NUM_BUCKETS);
+        return -1;
+    }
+
+    uint64_t num_nonces = capacity * NUM_BUCKETS; //A plot of at least one full batch has exactly 2^k slots
+    ChecksumHeader sums;
+    int sums_status = checksums_read_header(filename, &sums);
+    if (sums_status < 0) {
+        return -1;
+    }
+    if (sums_status == 0 && sums.nonce_end != 0) {
+        if (sums.nonce_end > num_nonces || (sums.nonce_end + NUM_BUCKETS * MAX_RECORDS_PER_BUCKET - 1) / (NUM_BUCKETS * MAX_RECORDS_PER_BUCKET) != capacity / MAX_RECORDS_PER_BUCKET) {
+            fprintf(stderr, "%s records %llu nonces, which does not fit its %zu record buckets\n", filename, (unsigned long long)sums.nonce_end, capacity);
+            return -1;
+        }
+        num_nonces = sums.nonce_end;
+    } else if (capacity == MAX_RECORDS_PER_BUCKET) { //Below 2^(B+R) nonces every plot is a single padded batch, the size no longer tells K
+        fprintf(stderr, "%s is a single batch plot with no nonce count in its %s side file, it may hold fewer than %llu nonces\n", filename, CHECKSUM_SUFFIX, (unsigned long long)num_nonces);
+        return -1;
+    }
+
+    init_shard_header(header, 0, num_nonces, capacity / MAX_RECORDS_PER_BUCKET); //The plot holds nonces 0 to num_nonces - 1
+    return 0;
+}
+
+int merge_shards(char** shard_files, size_t num_shards, char** output_files, size_t num_outputs, BucketFilter* filter, BucketChecksums* checksums, BucketLayout layout) {
+    FILE* shards[MAX_PATHS] = {0};
+    FILE* outputs[MAX_PATHS] = {0};
+    ShardHeader headers[MAX_PATHS];
+    Record* buffers[MAX_PATHS] = {0};
+    size_t counts[MAX_PATHS];
+    size_t heads[MAX_PATHS];
+    Record* merged = NULL;
+    Record* laid_out = NULL; //Merged records in the output layout, also where Eytzinger inputs are put back in order
+    long data_starts[MAX_PATHS]; //Where bucket 0 of each shard begins
+    size_t* chunks = NULL;
+    int status = -1;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        shards[i] = fopen(shard_files[i], "rb");
+        if (!shards[i]) {
+            perror("Failed to open shard");
+            goto cleanup;
+        }
+        setvbuf(shards[i], NULL, _IOFBF, SHARD_IO_BUFFER);
+
+        char magic[sizeof(headers[i].magic)];
+        bool is_shard = fread(magic, 1, sizeof(magic), shards[i]) == sizeof(magic) && memcmp(magic, SHARD_MAGIC, sizeof(magic)) == 0;
+        rewind(shards[i]);
+
+        if ((is_shard ? read_shard_header(shards[i], &headers[i]) : read_plot_as_shard(shards[i], shard_files[i], &headers[i])) != 0) {
+            fprintf(stderr, "Bad shard %s\n", shard_files[i]);
+            goto cleanup;
+        }
+
+        data_starts[i] = ftell(shards[i]);
+        buffers[i] = malloc(headers[i].records_per_bucket * sizeof(Record));
+        if (!buffers[i]) {
+            fprintf(stderr, "Failed to malloc buffer for shard %zu\n", i);
+            goto cleanup;
+        }
+    }
+
+    uint64_t covered = 0;
+    uint64_t nonce_end = 0;
+    for (size_t i = 0; i < num_shards; i++) { //Overlapping shards would put the same nonce in the plot twice
+        for (size_t j = i + 1; j < num_shards; j++) {
+            if (headers[i].start_nonce < headers[j].start_nonce + headers[j].num_nonces &&
+                headers[j].start_nonce < headers[i].start_nonce + headers[i].num_nonces) {
+                fprintf(stderr, "Shards %s and %s have overlapping nonce ranges\n", shard_files[i], shard_files[j]);
+                goto cleanup;
+            }
+        }
+        covered += headers[i].num_nonces;
+        if (headers[i].start_nonce + headers[i].num_nonces > nonce_end) nonce_end = headers[i].start_nonce + headers[i].num_nonces;
+    }
+    if (checksums) checksums->header.nonce_end = nonce_end;
+    if (covered != NUM_RECORDS) {
+        fprintf(stderr, "Warning: shards cover %lu of %llu nonces\n", (unsigned long)covered, NUM_RECORDS);
+    }
+
+    size_t chunk_buckets = SHARD_IO_BUFFER / BIG_BUCKET_SIZE > 0 ? SHARD_IO_BUFFER / BIG_BUCKET_SIZE : 1; //About one stdio buffer per stripe before the writes move to the next device
+    merged = malloc(RECORDS_BIG_BUCKET * sizeof(Record));
+    laid_out = malloc(RECORDS_BIG_BUCKET * sizeof(Record));
+    chunks = malloc((NUM_BUCKETS / chunk_buckets + num_outputs + 1) * sizeof(size_t));
+    if (!merged || !laid_out || !chunks) {
+        fprintf(stderr, "Failed to malloc merge buffer\n");
+        goto cleanup;
+    }
+
+    if (open_output_stripes(output_files, num_outputs, BIG_BUCKET_SIZE, 0, outputs) != 0) {
+        goto cleanup;
+    }
+    for (size_t s = 0; s < num_outputs; s++) {
+        setvbuf(outputs[s], NULL, _IOFBF, SHARD_IO_BUFFER);
+    }
+
+    double start_time = omp_get_wtime();
+    double last_print = start_time;
+    int print_count = 0;
+
+    size_t num_chunks = stripe_chunk_order(0, NUM_BUCKETS, chunk_buckets, num_outputs, chunks);
+    size_t next_bucket = 0;
+    size_t done = 0;
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t chunk_end = stripe_chunk_end(chunks[c], NUM_BUCKETS, chunk_buckets, num_outputs);
+        for (size_t i = 0; i < num_shards && chunks[c] != next_bucket; i++) { //A chunk of another stripe, every shard jumps to it
+            long stride = (long)(BUCKET_HEADER_SIZE + headers[i].records_per_bucket * sizeof(Record));
+            if (fseek(shards[i], data_starts[i] + (long)chunks[c] * stride, SEEK_SET) != 0) {
+                perror("Failed to seek shard");
+                goto cleanup;
+            }
+        }
+        next_bucket = chunk_end;
+
+        for (size_t bucket_index = chunks[c]; bucket_index < chunk_end; bucket_index++) {
+            for (size_t i = 0; i < num_shards; i++) { //Every shard is read a chunk at a time, one whole bucket after another
+                uint8_t count_bytes[BUCKET_HEADER_SIZE];
+                if (fread(count_bytes, 1, BUCKET_HEADER_SIZE, shards[i]) != BUCKET_HEADER_SIZE) {
+                    fprintf(stderr, "Failed to read count for shard %zu bucket %zu\n", i, bucket_index);
+                    goto cleanup;
+                }
+                counts[i] = decode_bucket_count(count_bytes);
+                heads[i] = 0;
+
+                if (counts[i] > headers[i].records_per_bucket) {
+                    fprintf(stderr, "Invalid count %zu in shard %zu bucket %zu\n", counts[i], i, bucket_index);
+                    goto cleanup;
+                }
+                if (fread(buffers[i], sizeof(Record), headers[i].records_per_bucket, shards[i]) != headers[i].records_per_bucket) {
+                    fprintf(stderr, "Failed to read records for shard %zu bucket %zu\n", i, bucket_index);
+                    goto cleanup;
+                }
+                if (decode_bucket_layout(count_bytes) == BUCKET_LAYOUT_EYTZINGER) {
+                    eytzinger_to_sorted(buffers[i], laid_out, counts[i]);
+                    memcpy(buffers[i], laid_out, counts[i] * sizeof(Record));
+                }
+            }
+
+            size_t total_records = 0;
+            while (total_records < RECORDS_BIG_BUCKET) { //Take the smallest head each time, anything past the bucket size is dropped
+                size_t best = num_shards;
+                for (size_t i = 0; i < num_shards; i++) {
+                    if (heads[i] < counts[i] && (best == num_shards || compare_records(&buffers[i][heads[i]], &buffers[best][heads[best]]) < 0)) {
+                        best = i;
+                    }
+                }
+                if (best == num_shards) break;
+                merged[total_records++] = buffers[best][heads[best]++];
+            }
+            if (filter) {
+                filter_add_bucket(filter, bucket_index, merged, total_records);
+            }
+            const Record* stored = merged;
+            if (layout == BUCKET_LAYOUT_EYTZINGER) {
+                eytzinger_from_sorted(merged, laid_out, total_records);
+                stored = laid_out;
+            }
+            if (checksums) {
+                checksums_add_bucket(checksums, bucket_index, stored, total_records, layout);
+            }
+
+            FILE* output = outputs[stripe_of_bucket(bucket_index, num_outputs)];
+
+            if (write_bucket_header(output, total_records, layout) != 0) {
+                perror("Failed to write bucket header");
+                goto cleanup;
+            }
+
+            if (fwrite(stored, sizeof(Record), total_records, output) != total_records) {
+                perror("Failed to write merged records");
+                goto cleanup;
+            }
+
+            if (skip_padding(output, RECORDS_BIG_BUCKET - total_records) != 0) {
+                perror("Failed to skip padding");
+                goto cleanup;
+            }
+
+            done++;
             double now = omp_get_wtime();
-            double interval = now - last_print;
-            if (interval >= PRINT_TIME) {
+            if (now - last_print >= PRINT_TIME) {
                 double elapsed = now - start_time;
-                double percent = (100.0 * completed) / NUM_BUCKETS;
-                double eta = elapsed * (NUM_BUCKETS - completed) / (completed + 1e-5);
-                double mb_done = completed * MAX_RECORDS_PER_BUCKET * sizeof(Record) / 1e6;
-                double mb_per_sec = mb_done / elapsed;
+                double percent = (100.0 * done) / NUM_BUCKETS;
+                double eta = elapsed * (NUM_BUCKETS - done) / done;
+                double mb_per_sec = (done * BIG_BUCKET_SIZE / 1e6) / elapsed;
 
                 print_count++;
-                printf("[%d][INMEM_SORT]: %.2f%% completed, ETA %.1f sec, %zu/%zu buckets, %.1f MB/sec\n",
-                    print_count, percent, eta, completed, (size_t)NUM_BUCKETS, mb_per_sec);
+                printf("[%d][SHARDMERGE]: %.2f%% completed, ETA %.1f seconds, %zu/%zu buckets, %.1f MB/sec\n",
+                    print_count, percent, eta, done, (size_t)NUM_BUCKETS, mb_per_sec);
                 fflush(stdout);
                 last_print = now;
             }
         }
     }
 
-    fclose(out);
+    status = 0;
+
+cleanup:
+    for (size_t i = 0; i < num_shards; i++) {
+        if (shards[i]) fclose(shards[i]);
+        free(buffers[i]);
+    }
+    for (size_t s = 0; s < num_outputs; s++) {
+        if (outputs[s] && fclose(outputs[s]) != 0 && status == 0) { //Buffered writes can still fail here
+            perror("Failed to close output stripe");
+            status = -1;
+        }
+    }
+    free(merged);
+    free(laid_out);
+    free(chunks);
+    return status;
+}
+
+static int compare_keys(const void* a, const void* b) {
+    uint64_t key_a = *(const uint64_t*)a;
+    uint64_t key_b = *(const uint64_t*)b;
+    return (key_a > key_b) - (key_a < key_b);
 }
 
+void sort_records_by_key(const Record* records, size_t count, Record* sorted, uint64_t* keys) {
+    if (count == 0) return;
 
+    int index_bits = count > 1 ? 64 - __builtin_clzll(count - 1) : 1;
+    uint64_t index_mask = (1ULL << index_bits) - 1;
+
+    for (size_t i = 0; i < count; i++) { //Every record in a bucket shares the top B bits, so shift those out and keep the index in the low bits
+        uint64_t key = (key_load_be64(records[i].hash) << B) | (((uint64_t)key_load_be16(records[i].hash + 8) << B) >> 16);
+        keys[i] = (key & ~index_mask) | i;
+    }
+
+    qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+    for (size_t i = 0; i < count; i++) { //Move each 16 byte record exactly once
+        sorted[i] = records[keys[i] & index_mask];
+    }
+
+    size_t run_start = 0; //Keys that tie above the index bits have only been ordered by index, settle those on the full hash
+    for (size_t i = 1; i <= count; i++) {
+        if (i == count || (keys[i] & ~index_mask) != (keys[run_start] & ~index_mask)) {
+            if (i - run_start > 1) {
+                qsort(&sorted[run_start], i - run_start, sizeof(Record), compare_records);
+            }
+            run_start = i;
+        }
+    }
+}
 
 int compare_records(const void* a, const void* b) { //Checks if a record is sorted or not by comparing them
     const Record* record_a = (const Record*)a;
     const Record* record_b = (const Record*)b;
-    return memcmp(record_a->hash, record_b->hash, HASH_SIZE);
+    int cmp = key_compare(record_a->hash, record_b->hash);
+    if (cmp != 0) return cmp;
+
+    uint64_t nonce_a = nonce_to_u64(record_a->nonce); //Equal hashes go in nonce order so the sort result never depends on the input order
+    uint64_t nonce_b = nonce_to_u64(record_b->nonce);
+    return (nonce_a > nonce_b) - (nonce_a < nonce_b);
 }
 
 int calc_prefix_bytes(size_t num_buckets){ //Makes sure the prefixes are big enough to index correctly to the bucket array
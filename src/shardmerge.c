@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <omp.h>
+
+#include "../include/pos.h"
+#include "../include/filter.h"
+#include "../include/checksum.h"
+
+int main(int argc, char* argv[]) {
+
+    char default_filename[] = "buckets.bin";
+    char* filename = default_filename;
+    char* shard_list = NULL;
+    bool debug = false;
+    int filter_bits_per_key = 0;
+    int filter_prefix_bytes = default_filter_prefix_bytes();
+    BucketLayout layout = BUCKET_LAYOUT_SORTED;
+    int opt;
+
+    while (( opt = getopt(argc, argv, "f:s:b:p:L:d:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                filename = optarg;
+                break;
+            case 's':
+                shard_list = optarg;
+                break;
+            case 'b':
+                filter_bits_per_key = atoi(optarg);
+                break;
+            case 'p':
+                filter_prefix_bytes = atoi(optarg);
+                break;
+            case 'L':
+                layout = strcmp(optarg, "eytzinger") == 0 ? BUCKET_LAYOUT_EYTZINGER : BUCKET_LAYOUT_SORTED;
+                break;
+            case 'd':
+                debug = strcmp(optarg, "true") == 0 || strcmp(optarg, "1") == 0;
+                break;
+            case 'h':
+                printf("Help:\n"
+                       "  -f <filename>: Specify the output filename, a comma separated list stripes the plot across files (default: buckets.bin)\n"
+                       "  -s <shards>: Comma separated list of shard files made with hashgen -a/-n\n"
+                       "  -b <bits_per_key>: Build a per bucket filter side file with this many bits per record, more bits lower the false positive rate (default: 0, off)\n"
+                       "  -p <prefix_bytes>: Hash prefix bytes stored in the filter (default: %d)\n"
+                       "  -L <layout>: Record order inside each bucket, sorted or eytzinger (default: sorted)\n"
+                       "  -d <bool>: Enable debug mode\n"
+                       "  -h: Display this help message\n", default_filter_prefix_bytes());
+                return 0;
+            default:
+                printf("Help:\n"
+                       "  -f <filename>: Specify the output filename, a comma separated list stripes the plot across files (default: buckets.bin)\n"
+                       "  -s <shards>: Comma separated list of shard files made with hashgen -a/-n\n"
+                       "  -b <bits_per_key>: Build a per bucket filter side file with this many bits per record, more bits lower the false positive rate (default: 0, off)\n"
+                       "  -p <prefix_bytes>: Hash prefix bytes stored in the filter (default: %d)\n"
+                       "  -L <layout>: Record order inside each bucket, sorted or eytzinger (default: sorted)\n"
+                       "  -d <bool>: Enable debug mode\n"
+                       "  -h: Display this help message\n", default_filter_prefix_bytes());
+                return 0;
+        }
+    }
+
+    if (!shard_list) {
+        fprintf(stderr, "No shards given, use -s\n");
+        return 1;
+    }
+
+    char* output_files[MAX_PATHS];
+    size_t num_outputs = split_paths(filename, output_files, MAX_PATHS);
+    char* shard_files[MAX_PATHS];
+    size_t num_shards = split_paths(shard_list, shard_files, MAX_PATHS);
+
+    if (num_outputs == 0 || num_outputs > NUM_BUCKETS || num_shards == 0) {
+        fprintf(stderr, "Need at least one shard and between 1 and %llu output files\n", NUM_BUCKETS);
+        return 1;
+    }
+
+    if (layout == BUCKET_LAYOUT_EYTZINGER && !EYTZINGER_SUPPORTED) {
+        fprintf(stderr, "Buckets of %llu records leave no count bit for the layout flag, build with COUNT_BITS=32\n", (unsigned long long)RECORDS_BIG_BUCKET);
+        return 1;
+    }
+
+    if (debug) {
+        printf("FILENAME=%s\n", output_files[0]);
+        printf("STRIPES=%zu\n", num_outputs);
+        printf("SHARDS=%zu\n", num_shards);
+        printf("BUCKETS=%lld\n", NUM_BUCKETS);
+        printf("RECORDS_PER_BUCKET=%zu\n", (size_t)RECORDS_BIG_BUCKET);
+    }
+
+    BucketFilter filter = {0};
+    if (filter_bits_per_key > 0 && filter_init(&filter, filter_bits_per_key, filter_prefix_bytes, RECORDS_BIG_BUCKET) != 0) {
+        return 1;
+    }
+    BucketChecksums checksums = {0};
+    if (checksums_init(&checksums) != 0) {
+        filter_free(&filter);
+        return 1;
+    }
+
+    double start_time = omp_get_wtime();
+
+    if (merge_shards(shard_files, num_shards, output_files, num_outputs, filter.blocks ? &filter : NULL, &checksums, layout) != 0) {
+        fprintf(stderr, "Failed to merge shards\n");
+        filter_free(&filter);
+        checksums_free(&checksums);
+        return 1;
+    }
+
+    if (filter.blocks) {
+        if (filter_save(&filter, output_files[0]) != 0) {
+            fprintf(stderr, "Failed to write the filter\n");
+        }
+        filter_free(&filter);
+    }
+    if (checksums_save(&checksums, output_files[0]) != 0) {
+        fprintf(stderr, "Failed to write the checksums\n");
+    }
+    checksums_free(&checksums);
+
+    for (size_t s = 0; s < num_outputs; s++) {
+        FILE* out_final = fopen(output_files[s], "rb+");
+        if (out_final) {
+            fflush(out_final);
+            fsync(fileno(out_final));
+            fclose(out_final);
+        }
+    }
+
+    double total_time = omp_get_wtime() - start_time;
+    double mbps = ((NUM_BUCKETS * BIG_BUCKET_SIZE) / 1e6) / total_time;
+
+    printf("Merged %zu shards into %s (%zu stripes) in %.2f seconds : %.2f MB/s\n", num_shards, output_files[0], num_outputs, total_time, mbps);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "../include/stats.h"
+
+static size_t hist_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_BUCKETS) return value; //Small values get exact buckets
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - 5; //Keep 6 significant bits, the top one is implied by the shift
+    size_t index = (size_t)shift * HIST_SUB_BUCKETS + (value >> shift);
+    return index < HIST_SIZE ? index : HIST_SIZE - 1;
+}
+
+static uint64_t hist_value(size_t index) { //Largest value that lands in this index
+    if (index < 2 * HIST_SUB_BUCKETS) return index;
+
+    size_t shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = index - shift * HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init(LatencyHistogram* hist) {
+    memset(hist, 0, sizeof(LatencyHistogram));
+    hist->min = UINT64_MAX;
+}
+
+void hist_record(LatencyHistogram* hist, uint64_t value_ns) {
+    hist->counts[hist_index(value_ns)]++;
+    hist->total++;
+    hist->sum += value_ns;
+    if (value_ns < hist->min) hist->min = value_ns;
+    if (value_ns > hist->max) hist->max = value_ns;
+}
+
+void hist_merge(LatencyHistogram* dst, const LatencyHistogram* src) {
+    for (size_t i = 0; i < HIST_SIZE; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const LatencyHistogram* hist, double percentile) {
+    if (hist->total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_SIZE; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void report_init(LookupReport* report) {
+    hist_init(&report->all);
+    hist_init(&report->cold);
+    hist_init(&report->warm);
+    report->found = 0;
+    report->seeks = 0;
+    report->bytes_read = 0;
+}
+
+void report_record(LookupReport* report, uint64_t latency_ns, bool cold, bool found, uint64_t seeks, uint64_t bytes_read) {
+    hist_record(&report->all, latency_ns);
+    hist_record(cold ? &report->cold : &report->warm, latency_ns);
+    report->found += found;
+    report->seeks += seeks;
+    report->bytes_read += bytes_read;
+}
+
+void report_merge(LookupReport* dst, const LookupReport* src) {
+    hist_merge(&dst->all, &src->all);
+    hist_merge(&dst->cold, &src->cold);
+    hist_merge(&dst->warm, &src->warm);
+    dst->found += src->found;
+    dst->seeks += src->seeks;
+    dst->bytes_read += src->bytes_read;
+}
+
+static void print_hist(const char* name, const LatencyHistogram* hist) {
+    if (hist->total == 0) {
+        printf("%-5s lookups: 0\n", name);
+        return;
+    }
+    printf("%-5s lookups: %lu, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+        name, (unsigned long)hist->total, hist->sum / hist->total / 1e3,
+        hist_percentile(hist, 50.0) / 1e3, hist_percentile(hist, 99.0) / 1e3,
+        hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+}
+
+void report_print(const LookupReport* report, double elapsed_ms) {
+    uint64_t lookups = report->all.total;
+
+    printf("Number of total lookups: %lu\n", (unsigned long)lookups);
+    printf("Number of records found: %lu\n", (unsigned long)report->found);
+    printf("Number of total seeks: %lu\n", (unsigned long)report->seeks);
+    printf("Bytes read: %lu (%.1f per lookup)\n", (unsigned long)report->bytes_read, lookups ? (double)report->bytes_read / lookups : 0.0);
+    printf("Time taken: %.4f ms/lookup\n", lookups ? elapsed_ms / lookups : 0.0);
+    printf("Throughput: %.2f lookups/s\n", lookups / (elapsed_ms / 1000.0));
+    print_hist("All", &report->all);
+    print_hist("Cold", &report->cold);
+    print_hist("Warm", &report->warm);
+}
+
+static void write_hist_json(FILE* file, const char* indent, const char* name, const LatencyHistogram* hist, bool last) {
+    fprintf(file, "%s\"%s\": {\"count\": %lu, \"mean_ns\": %.1f, \"min_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}%s\n",
+        indent, name, (unsigned long)hist->total, hist->total ? hist->sum / hist->total : 0.0,
+        (unsigned long)(hist->total ? hist->min : 0), (unsigned long)hist_percentile(hist, 50.0),
+        (unsigned long)hist_percentile(hist, 99.0), (unsigned long)hist_percentile(hist, 99.9),
+        (unsigned long)hist->max, last ? "" : ",");
+}
+
+static void write_report_json(FILE* file, const char* indent, const LookupReport* report, double elapsed_ms) {
+    fprintf(file, "%s\"lookups\": %lu,\n", indent, (unsigned long)report->all.total);
+    fprintf(file, "%s\"found\": %lu,\n", indent, (unsigned long)report->found);
+    fprintf(file, "%s\"seeks\": %lu,\n", indent, (unsigned long)report->seeks);
+    fprintf(file, "%s\"bytes_read\": %lu,\n", indent, (unsigned long)report->bytes_read);
+    fprintf(file, "%s\"elapsed_ms\": %.3f,\n", indent, elapsed_ms);
+    write_hist_json(file, indent, "all", &report->all, false);
+    write_hist_json(file, indent, "cold", &report->cold, false);
+    write_hist_json(file, indent, "warm", &report->warm, true);
+}
+
+int report_write_json(const LookupReport* reports, const char* const* names, const double* elapsed_ms, size_t num_reports, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open JSON report");
+        return -1;
+    }
+
+    fprintf(file, "{\n");
+    if (num_reports == 1) {
+        write_report_json(file, "  ", &reports[0], elapsed_ms[0]);
+    } else {
+        for (size_t i = 0; i < num_reports; i++) {
+            fprintf(file, "  \"%s\": {\n", names[i]);
+            write_report_json(file, "    ", &reports[i], elapsed_ms[i]);
+            fprintf(file, "  }%s\n", i + 1 < num_reports ? "," : "");
+        }
+    }
+    fprintf(file, "}\n");
+
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <time.h>
+
+#include "../include/trace.h"
+
+#ifdef POS_TRACE
+
+typedef struct {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} TraceEvent;
+
+typedef struct TraceRing {
+    pid_t tid;
+    int index; //Registration order, used as the thread name
+    uint64_t written; //Total spans recorded, the ring holds the last TRACE_RING_EVENTS of them
+    TraceEvent events[TRACE_RING_EVENTS];
+    struct TraceRing* next;
+} TraceRing;
+
+static TraceRing* trace_rings = NULL; //Every thread that ever traced, pushed without a lock
+static int trace_num_rings = 0;
+static _Thread_local TraceRing* trace_ring = NULL;
+
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static TraceRing* trace_register(void) { //First span of a thread, the ring lives until the process exits
+    TraceRing* ring = calloc(1, sizeof(TraceRing));
+    if (!ring) return NULL;
+    ring->tid = gettid();
+    ring->index = __atomic_fetch_add(&trace_num_rings, 1, __ATOMIC_RELAXED);
+
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return ring;
+}
+
+void trace_span(const char* name, uint64_t start_ns, uint64_t end_ns) {
+    if (!trace_ring) {
+        trace_ring = trace_register();
+        if (!trace_ring) return;
+    }
+    TraceEvent* event = &trace_ring->events[trace_ring->written % TRACE_RING_EVENTS];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    trace_ring->written++;
+}
+
+int trace_write(const char* filename) { //Call once the traced threads are idle
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    uint64_t origin = UINT64_MAX; //Timestamps start at the first span so the viewer opens on the run
+    for (TraceRing* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t kept = ring->written < TRACE_RING_EVENTS ? ring->written : TRACE_RING_EVENTS;
+        for (uint64_t i = ring->written - kept; i < ring->written; i++) {
+            if (ring->events[i % TRACE_RING_EVENTS].start_ns < origin) origin = ring->events[i % TRACE_RING_EVENTS].start_ns;
+        }
+    }
+
+    pid_t pid = getpid();
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TraceRing* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", (int)pid, (int)ring->tid, ring->index);
+        first = false;
+        if (ring->written > TRACE_RING_EVENTS) {
+            fprintf(stderr, "Thread %d overran its trace ring, kept its last %d spans\n", ring->index, TRACE_RING_EVENTS);
+        }
+
+        uint64_t kept = ring->written < TRACE_RING_EVENTS ? ring->written : TRACE_RING_EVENTS;
+        for (uint64_t i = ring->written - kept; i < ring->written; i++) {
+            const TraceEvent* event = &ring->events[i % TRACE_RING_EVENTS];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event->name, (int)pid, (int)ring->tid,
+                    (event->start_ns - origin) / 1000.0, (event->end_ns - event->start_ns) / 1000.0);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        perror("Failed to write trace file");
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int trace_write(const char* filename) {
+    (void)filename;
+    fprintf(stderr, "Tracing is compiled out, build with make TRACE=1\n");
+    return -1;
+}
+
+#endif
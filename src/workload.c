@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "../BLAKE3/c/blake3.h"
+#include "../include/workload.h"
+#include "../include/lookup.h"
+
+typedef struct { //xoshiro256**, seeded through splitmix64
+    uint64_t s[4];
+} Rng;
+
+static uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void rng_seed(Rng* rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&seed);
+    }
+}
+
+static uint64_t rng_next(Rng* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = ((s[1] * 5) << 7 | (s[1] * 5) >> 57) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+static double rng_double(Rng* rng) { //[0, 1)
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t rng_below(Rng* rng, uint64_t bound) {
+    return (uint64_t)(((unsigned __int128)rng_next(rng) * bound) >> 64);
+}
+
+typedef struct { //Rejection-inversion sampling (Hormann and Derflinger), O(1) per draw for any key space
+    double s;
+    double n;
+    double h_integral_x1;
+    double h_integral_n;
+    double threshold;
+} ZipfSampler;
+
+static double zipf_helper1(double x) { //log1p(x) / x
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1.0 - x / 2.0;
+}
+
+static double zipf_helper2(double x) { //expm1(x) / x
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1.0 + x / 2.0;
+}
+
+static double zipf_h_integral(const ZipfSampler* z, double x) {
+    double log_x = log(x);
+    return zipf_helper2((1.0 - z->s) * log_x) * log_x;
+}
+
+static double zipf_h(const ZipfSampler* z, double x) {
+    return exp(-z->s * log(x));
+}
+
+static double zipf_h_integral_inverse(const ZipfSampler* z, double x) {
+    double t = x * (1.0 - z->s);
+    if (t < -1.0) t = -1.0;
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(ZipfSampler* z, uint64_t n, double s) {
+    z->s = s;
+    z->n = (double)n;
+    z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1.0;
+    z->h_integral_n = zipf_h_integral(z, z->n + 0.5);
+    z->threshold = 2.0 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2.0));
+}
+
+static uint64_t zipf_sample(const ZipfSampler* z, Rng* rng) { //Rank 1 is the most popular
+    for (;;) {
+        double u = z->h_integral_n + rng_double(rng) * (z->h_integral_x1 - z->h_integral_n);
+        double x = zipf_h_integral_inverse(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1.0) k = 1.0;
+        else if (k > z->n) k = z->n;
+
+        if (k - x <= z->threshold || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k)) {
+            return (uint64_t)k;
+        }
+    }
+}
+
+void workload_defaults(WorkloadConfig* config) {
+    config->distribution = DIST_UNIFORM;
+    config->seed = 1;
+    config->hit_ratio = 0.0;
+    config->hot_fraction = 0.01;
+    config->hot_weight = 0.9;
+    config->zipf_s = 0.99;
+    config->key_space = NUM_RECORDS;
+}
+
+int parse_distribution(const char* spec, WorkloadConfig* config) {
+    if (strncmp(spec, "uniform", 7) == 0) {
+        config->distribution = DIST_UNIFORM;
+        return 0;
+    }
+    if (strncmp(spec, "hotspot", 7) == 0) {
+        config->distribution = DIST_HOTSPOT;
+        const char* params = strchr(spec, ':');
+        if (params) sscanf(params, ":%lf:%lf", &config->hot_fraction, &config->hot_weight);
+        return (config->hot_fraction > 0 && config->hot_fraction <= 1 && config->hot_weight >= 0 && config->hot_weight <= 1) ? 0 : -1;
+    }
+    if (strncmp(spec, "zipf", 4) == 0) {
+        config->distribution = DIST_ZIPF;
+        const char* params = strchr(spec, ':');
+        if (params) sscanf(params, ":%lf", &config->zipf_s);
+        return config->zipf_s > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+static uint64_t pick_key(const WorkloadConfig* config, const ZipfSampler* zipf, Rng* rng) {
+    switch (config->distribution) {
+        case DIST_HOTSPOT: {
+            uint64_t hot_keys = (uint64_t)(config->key_space * config->hot_fraction);
+            if (hot_keys < 1) hot_keys = 1;
+            if (hot_keys >= config->key_space || rng_double(rng) < config->hot_weight) {
+                return rng_below(rng, hot_keys);
+            }
+            return hot_keys + rng_below(rng, config->key_space - hot_keys);
+        }
+        case DIST_ZIPF:
+            return zipf_sample(zipf, rng) - 1;
+        default:
+            return rng_below(rng, config->key_space);
+    }
+}
+
+int workload_generate(Workload* workload, const WorkloadConfig* config, size_t count, int prefix_bytes) {
+    if (prefix_bytes < 1 || prefix_bytes > HASH_SIZE || config->key_space == 0) {
+        fprintf(stderr, "Invalid prefix length: %d\n", prefix_bytes);
+        return -1;
+    }
+
+    workload->queries = calloc(count > 0 ? count : 1, HASH_SIZE);
+    if (!workload->queries) {
+        fprintf(stderr, "Memory allocation failed for queries\n");
+        return -1;
+    }
+    workload->count = count;
+    workload->prefix_bytes = prefix_bytes;
+    workload->expected_hits = 0;
+
+    Rng rng;
+    rng_seed(&rng, config->seed);
+
+    ZipfSampler zipf = {0};
+    if (config->distribution == DIST_ZIPF) {
+        zipf_init(&zipf, config->key_space, config->zipf_s);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = pick_key(config, &zipf, &rng);
+
+        if (rng_double(&rng) < config->hit_ratio) { //Key i is nonce i, so its hash prefix is in the plot unless its bucket overflowed
+            uint8_t nonce[NONCE_SIZE];
+            uint8_t hash[HASH_SIZE];
+            blake3_hasher hasher;
+
+            nonce_from_u64(key % NUM_RECORDS, nonce);
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, nonce, NONCE_SIZE);
+            blake3_hasher_finalize(&hasher, hash, HASH_SIZE);
+            memcpy(workload->queries[i], hash, prefix_bytes);
+            workload->expected_hits++;
+        } else { //The same key always maps to the same random prefix so skewed distributions repeat misses too
+            uint64_t state = key ^ (config->seed * 0xd1b54a32d192ed03ULL);
+            for (int j = 0; j < prefix_bytes; j += 8) {
+                uint64_t bits = splitmix64(&state);
+                for (int b = j; b < prefix_bytes && b < j + 8; b++) {
+                    workload->queries[i][b] = (bits >> (8 * (b - j))) & 0xFF;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int workload_save(const Workload* workload, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    fprintf(file, "%s%d\n", TRACE_HEADER, workload->prefix_bytes);
+    for (size_t i = 0; i < workload->count; i++) {
+        for (int j = 0; j < workload->prefix_bytes; j++) {
+            fprintf(file, "%02x", workload->queries[i][j]);
+        }
+        fputc('\n', file);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int workload_load(Workload* workload, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    size_t capacity = 1024;
+    workload->queries = calloc(capacity, HASH_SIZE);
+    workload->count = 0;
+    workload->prefix_bytes = 0;
+    workload->expected_hits = 0;
+    if (!workload->queries) {
+        fprintf(stderr, "Memory allocation failed for queries\n");
+        fclose(file);
+        return -1;
+    }
+
+    char line[2 * HASH_SIZE + 64];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue; //Header and comments
+
+        int prefix_bytes = strlen(line) / 2;
+        if (workload->prefix_bytes == 0) workload->prefix_bytes = prefix_bytes;
+
+        if (prefix_bytes != workload->prefix_bytes || prefix_bytes > HASH_SIZE) {
+            fprintf(stderr, "Trace line %zu has a different prefix length\n", workload->count + 1);
+            workload_free(workload);
+            fclose(file);
+            return -1;
+        }
+
+        if (workload->count == capacity) {
+            capacity *= 2;
+            uint8_t (*grown)[HASH_SIZE] = realloc(workload->queries, capacity * HASH_SIZE);
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed for queries\n");
+                workload_free(workload);
+                fclose(file);
+                return -1;
+            }
+            workload->queries = grown;
+        }
+
+        memset(workload->queries[workload->count], 0, HASH_SIZE);
+        if (!parse_hex_string(line, workload->queries[workload->count], prefix_bytes)) {
+            fprintf(stderr, "Bad hex on trace line %zu\n", workload->count + 1);
+            workload_free(workload);
+            fclose(file);
+            return -1;
+        }
+        workload->count++;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+void workload_free(Workload* workload) {
+    free(workload->queries);
+    workload->queries = NULL;
+    workload->count = 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Golden digest regression for plot output. make check builds the tools at K=20 B=10 R=8 into build/check
+# and runs this. Every plot is compared whole, headers and padding included, with hashverify -g. The plot
+# must not depend on the thread counts, the scratch directories or the stripes.
+#
+# Usage: tests/check.sh <bin_dir>             compare against tests/golden_k20_b10_r8.txt
+#        tests/check.sh <bin_dir> --update    rewrite the golden file, only from a build against the real BLAKE3
+
+BIN=${1:-build/check}
+GOLDEN=$(dirname "$0")/golden_k20_b10_r8.txt
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$WORK/scratch1" "$WORK/scratch2" "$WORK/scratch3" "$WORK/scratch4" "$WORK/scratch5"
+
+failed=0
+update=0
+[ "${2:-}" = "--update" ] && update=1 && : > "$GOLDEN.new"
+
+digest() { # Prints the digest hashverify -g gives for the plot or stripe list
+    "$BIN/hashverify" -f "$1" -g true | sed -n 's/^File digest: //p'
+}
+
+check() { # <golden name> <plot, or stripes separated by commas> then the hashgen or shardmerge command line
+    name=$1
+    plot=$2
+    shift 2
+    if ! "$@" > "$WORK/log" 2>&1; then
+        echo "FAIL $name: $* exited non-zero"
+        cat "$WORK/log"
+        failed=1
+        return
+    fi
+    got=$(digest "$plot")
+    if [ $update -eq 1 ]; then
+        grep -q "^$name " "$GOLDEN.new" || echo "$name $got" >> "$GOLDEN.new"
+        echo "RECORD $name $got"
+        return
+    fi
+    want=$(sed -n "s/^$name //p" "$GOLDEN" 2>/dev/null)
+    if [ -n "$want" ] && [ "$got" = "$want" ]; then
+        echo "ok   $name: $*"
+    else
+        echo "FAIL $name: $* gave ${got:-no digest}, expected ${want:-nothing in $GOLDEN}"
+        failed=1
+    fi
+}
+
+cd "$WORK" || exit 1
+case $BIN in /*) ;; *) BIN=$OLDPWD/$BIN ;; esac
+case $GOLDEN in /*) ;; *) GOLDEN=$OLDPWD/$GOLDEN ;; esac
+
+#Streaming through the temp file
+check stream p1.bin "$BIN/hashgen" -f p1.bin -t 1 -o 1 -i 1
+check stream p2.bin "$BIN/hashgen" -f p2.bin -t 4 -o 2 -i 3
+check stream p3.bin "$BIN/hashgen" -f p3.bin -t 3 -o 4 -i 2 -T scratch1,scratch2
+check stream p4.bin "$BIN/hashgen" -f p4.bin -t 2 -o 1 -i 1 -T scratch1,scratch2,scratch3,scratch4,scratch5
+check stream s1.bin,s2.bin,s3.bin "$BIN/hashgen" -f s1.bin,s2.bin,s3.bin -t 2 -o 3 -i 4
+check stream_sums p1.bin.sums true #Side file of the first plot, nothing to run
+check stream_eytzinger e1.bin "$BIN/hashgen" -f e1.bin -L eytzinger -t 1 -o 1 -i 1
+check stream_eytzinger e2.bin "$BIN/hashgen" -f e2.bin -L eytzinger -t 4 -o 3 -i 2
+
+#In memory and recompute keep the lowest nonces of the whole bucket rather than of each batch
+check in_memory k1.bin "$BIN/hashgen" -f k1.bin -k true -m 256 -t 1 -o 1
+check in_memory k2.bin "$BIN/hashgen" -f k2.bin -k true -m 256 -t 4 -o 3
+check in_memory r1.bin "$BIN/hashgen" -f r1.bin -R true -m 11 -t 3 -o 1
+check in_memory r2.bin,r3.bin "$BIN/hashgen" -f r2.bin,r3.bin -R true -m 64 -t 2 -o 2
+
+#Shards merged into one plot
+"$BIN/hashgen" -f a.shard -a 0 -n 400000 -t 2 > /dev/null
+"$BIN/hashgen" -f b.shard -a 400000 -t 3 -i 2 > /dev/null
+check shardmerge m1.bin "$BIN/shardmerge" -f m1.bin -s a.shard,b.shard
+check shardmerge m2.bin,m3.bin "$BIN/shardmerge" -f m2.bin,m3.bin -s b.shard,a.shard
+
+if [ $update -eq 1 ]; then
+    mv "$GOLDEN.new" "$GOLDEN"
+    echo "Wrote $GOLDEN"
+    exit 0
+fi
+[ $failed -eq 0 ] && echo "All plots match their golden digests"
+exit $failed